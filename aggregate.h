@@ -0,0 +1,276 @@
+#ifndef aggregate_h
+#define aggregate_h
+
+#include "buffer.h"
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <assert.h>
+
+namespace buffer {
+
+  // An aggregate over the elements of a collection, maintained incrementally:
+  // an insertion adds an element, a deletion retracts it and a substitution
+  // does both.
+  template <typename T>
+  class Aggregate {
+  public:
+    virtual ~Aggregate() {}
+
+    // Empties the aggregate.
+    virtual void clear() = 0;
+
+    virtual void add(const T &value) = 0;
+    virtual void remove(const T &value) = 0;
+  };
+
+  // The number of elements.
+  template <typename T>
+  class Count: public Aggregate<T> {
+  private:
+    size_t count_ = 0;
+
+  public:
+    size_t value() const {
+      return count_;
+    }
+
+    virtual void clear() {
+      count_ = 0;
+    }
+
+    virtual void add(const T &) {
+      count_++;
+    }
+
+    virtual void remove(const T &) {
+      count_--;
+    }
+  };
+
+  // The sum of a quantity extracted from every element.
+  template <typename T, typename V>
+  class Sum: public Aggregate<T> {
+  private:
+    std::function<V (const T &)> value_fnc_;
+    V sum_ = V();
+
+  public:
+    explicit Sum(std::function<V (const T &)> value_fnc): value_fnc_(value_fnc) {}
+
+    V value() const {
+      return sum_;
+    }
+
+    virtual void clear() {
+      sum_ = V();
+    }
+
+    virtual void add(const T &value) {
+      sum_ += value_fnc_(value);
+    }
+
+    virtual void remove(const T &value) {
+      sum_ -= value_fnc_(value);
+    }
+  };
+
+  // The first of the quantities extracted from the elements, in the order
+  // defined by 'Compare' (the minimum for 'std::less').
+  // The distinct quantities are kept in an indexed binary heap: a hash map
+  // holds the position of every quantity in the heap and its multiplicity, so
+  // that any of them can be retracted in O(log n).
+  template <typename T, typename V, typename Compare = std::less<V>>
+  class Extremum: public Aggregate<T> {
+  private:
+    struct Slot {
+      size_t position;
+      size_t count;
+    };
+
+    std::function<V (const T &)> value_fnc_;
+    std::vector<V> heap_;
+    std::unordered_map<V, Slot> slots_;
+    Compare compare_;
+
+  public:
+    explicit Extremum(std::function<V (const T &)> value_fnc): value_fnc_(value_fnc) {}
+
+    bool empty() const {
+      return heap_.empty();
+    }
+
+    // The extremum; the aggregate must not be empty.
+    const V &value() const {
+      assert(!heap_.empty());
+      return heap_.front();
+    }
+
+    virtual void clear() {
+      heap_.clear();
+      slots_.clear();
+    }
+
+    virtual void add(const T &value) {
+      auto v = value_fnc_(value);
+      auto it = slots_.find(v);
+      if (it != slots_.end()) {
+        it->second.count++;
+        return;
+      }
+      slots_.emplace(v, Slot{heap_.size(), 1});
+      heap_.push_back(v);
+      up(heap_.size() - 1);
+    }
+
+    virtual void remove(const T &value) {
+      // tolerates values that were never added.
+      auto it = slots_.find(value_fnc_(value));
+      if (it == slots_.end()) return;
+      if (--it->second.count) return;
+      auto position = it->second.position;
+      slots_.erase(it);
+      auto last = heap_.size() - 1;
+      if (position != last) {
+        heap_[position] = std::move(heap_[last]);
+        slots_[heap_[position]].position = position;
+      }
+      heap_.pop_back();
+      if (position < heap_.size() && !up(position)) down(position);
+    }
+
+  private:
+
+    void swap(size_t a, size_t b) {
+      std::swap(heap_[a], heap_[b]);
+      slots_[heap_[a]].position = a;
+      slots_[heap_[b]].position = b;
+    }
+
+    // Moves the entry towards the root, returns whether it moved.
+    bool up(size_t position) {
+      auto moved = false;
+      while (position > 0) {
+        auto parent = (position - 1) / 2;
+        if (!compare_(heap_[position], heap_[parent])) break;
+        swap(position, parent);
+        position = parent;
+        moved = true;
+      }
+      return moved;
+    }
+
+    void down(size_t position) {
+      while (true) {
+        auto first = position;
+        auto left = 2 * position + 1, right = left + 1;
+        if (left < heap_.size() && compare_(heap_[left], heap_[first])) first = left;
+        if (right < heap_.size() && compare_(heap_[right], heap_[first])) first = right;
+        if (first == position) return;
+        swap(position, first);
+        position = first;
+      }
+    }
+  };
+
+  template <typename T, typename V>
+  using Min = Extremum<T, V, std::less<V>>;
+
+  template <typename T, typename V>
+  using Max = Extremum<T, V, std::greater<V>>;
+
+  // The number of elements of every group.
+  template <typename T, typename K>
+  class GroupCount: public Aggregate<T> {
+  private:
+    std::function<K (const T &)> key_fnc_;
+    std::unordered_map<K, size_t> counts_;
+
+  public:
+    explicit GroupCount(std::function<K (const T &)> key_fnc): key_fnc_(key_fnc) {}
+
+    // The non-empty groups and their sizes.
+    const std::unordered_map<K, size_t> &value() const {
+      return counts_;
+    }
+
+    size_t count(const K &key) const {
+      auto it = counts_.find(key);
+      return it != counts_.end() ? it->second : 0;
+    }
+
+    virtual void clear() {
+      counts_.clear();
+    }
+
+    virtual void add(const T &value) {
+      counts_[key_fnc_(value)]++;
+    }
+
+    virtual void remove(const T &value) {
+      auto it = counts_.find(key_fnc_(value));
+      if (it == counts_.end()) return;
+      if (!--it->second) counts_.erase(it);
+    }
+  };
+
+  // Maintains a set of aggregates from the updates of a buffer, in O(k) per
+  // update of k edits (O(k log n) for the extrema) instead of a rescan.
+  // Attach it to the buffer with 'addUpdateListener'.
+  template <typename T>
+  class Aggregator: public UpdateListener<T> {
+  private:
+    std::vector<Aggregate<T>*> aggregates_;
+    std::shared_ptr<const std::vector<T>> collection_;
+    std::mutex lock_;
+
+  public:
+
+    // The aggregates must outlive the aggregator. An aggregate added after
+    // the first update is populated from the current collection.
+    void addAggregate(Aggregate<T> &aggregate) {
+      std::lock_guard<std::mutex> lock(lock_);
+      aggregate.clear();
+      if (collection_)
+        for (auto &value : *collection_) aggregate.add(value);
+      aggregates_.push_back(&aggregate);
+    }
+
+    void removeAggregate(Aggregate<T> &aggregate) {
+      std::lock_guard<std::mutex> lock(lock_);
+      aggregates_.erase(std::remove(aggregates_.begin(), aggregates_.end(), &aggregate), aggregates_.end());
+    }
+
+    // Runs 'reader' while no update is being applied, to read consistent
+    // values from other threads.
+    void read(const std::function<void ()> &reader) {
+      std::lock_guard<std::mutex> lock(lock_);
+      reader();
+    }
+
+    virtual void onBufferUpdate(const Update<T> &update) {
+      std::lock_guard<std::mutex> lock(lock_);
+      // the collection is only retained to populate late aggregates.
+      collection_ = update.collection;
+      if (!update.diffs) {
+        for (auto aggregate : aggregates_) {
+          aggregate->clear();
+          for (auto &value : *collection_) aggregate->add(value);
+        }
+        return;
+      }
+      for (auto &diff : *update.diffs) {
+        for (auto aggregate : aggregates_) {
+          if (diff.type != INSERT) aggregate->remove(diff.previous);
+          if (diff.type != DELETE) aggregate->add(diff.value);
+        }
+      }
+    }
+  };
+}
+
+#endif /* aggregate_h */
@@ -0,0 +1,121 @@
+#ifndef arena_h
+#define arena_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+namespace buffer {
+
+  // A monotonic allocator for scratch memory: allocations bump a pointer into
+  // the current block, deallocations are no-ops and 'reset' releases
+  // everything at once while keeping the memory for the next cycle.
+  // Once the arena has grown to the size of a cycle, the following cycles
+  // perform no heap allocation.
+  class Arena {
+  private:
+    struct Block {
+      std::unique_ptr<uint8_t[]> data;
+      size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    size_t current_ = 0;    // The block being filled.
+    size_t offset_ = 0;     // The first free byte in the current block.
+    size_t block_size_;
+
+  public:
+
+    explicit Arena(size_t block_size = 1 << 16): block_size_(std::max<size_t>(block_size, 64)) {}
+
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+
+    void *allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+      while (current_ < blocks_.size()) {
+        auto &block = blocks_[current_];
+        auto address = reinterpret_cast<uintptr_t>(block.data.get()) + offset_;
+        auto padding = (alignment - address % alignment) % alignment;
+        if (offset_ + padding + size <= block.size) {
+          offset_ += padding + size;
+          return block.data.get() + offset_ - size;
+        }
+        current_++;
+        offset_ = 0;
+      }
+      auto last = blocks_.empty() ? 0 : blocks_.back().size;
+      auto block_size = std::max(std::max(block_size_, size + alignment), 2 * last);
+      blocks_.push_back(Block{std::unique_ptr<uint8_t[]>(new uint8_t[block_size]), block_size});
+      current_ = blocks_.size() - 1;
+      return allocate(size, alignment);
+    }
+
+    // Releases all the allocations. When the last cycle spilled over several
+    // blocks they are replaced by a single one large enough for all of them.
+    void reset() {
+      if (blocks_.size() > 1) {
+        size_t size = 0;
+        for (auto &block : blocks_) size += block.size;
+        blocks_.clear();
+        blocks_.push_back(Block{std::unique_ptr<uint8_t[]>(new uint8_t[size]), size});
+      }
+      current_ = 0;
+      offset_ = 0;
+    }
+
+    // Releases all the allocations and frees the memory.
+    void release() {
+      blocks_.clear();
+      current_ = 0;
+      offset_ = 0;
+    }
+
+    // The memory owned by the arena, in bytes.
+    size_t capacity() const {
+      size_t size = 0;
+      for (auto &block : blocks_) size += block.size;
+      return size;
+    }
+  };
+
+  // Standard allocator drawing from an arena, e.g. for the containers used as
+  // scratch memory while computing a diff. The arena must outlive them.
+  template <typename T>
+  class ArenaAllocator {
+  private:
+    Arena *arena_;
+
+  public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena &arena): arena_(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other): arena_(other.arena()) {}
+
+    T *allocate(size_t count) {
+      return static_cast<T*>(arena_->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, size_t) {}
+
+    Arena *arena() const {
+      return arena_;
+    }
+  };
+
+  template <typename T, typename U>
+  bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena() == b.arena();
+  }
+
+  template <typename T, typename U>
+  bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena() != b.arena();
+  }
+}
+
+#endif /* arena_h */
@@ -0,0 +1,293 @@
+//
+//  bench.cxx
+//  bufferlib
+//
+//  Benchmarks of the diffs and of the Buffer update pipeline; the results are
+//  printed on stdout as JSON. See README.md for how to build and run them.
+//
+//    bench [min seconds per case = 0.2] [name filter]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <sys/resource.h>
+#include "buffer.h"
+#include "chunk.h"
+
+// every heap allocation of the process is counted. The array forms go
+// through the same functions (the aligned ones are C++17, and unused here).
+static std::atomic<uint64_t> allocations(0);
+
+// gcc sees the 'free' of memory obtained from 'operator new' once both are
+// inlined, but these are the replaced operators themselves.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto pointer = malloc(size ? size : 1)) return pointer;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+  operator delete(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+  operator delete(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+  operator delete(pointer);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  // The largest side for which the full memoization table (4 bytes per cell)
+  // stays within 64 MiB; larger inputs only go through the chunked diff, and
+  // only when their edits are local.
+  const size_t kMaxTableSide = 4095;
+
+  struct Options {
+    double min_seconds = 0.2;
+    std::string filter;
+  };
+
+  Options options;
+  bool is_first_result = true;
+
+  // Peak resident set size of the process, in KiB. It never decreases, so it
+  // is an upper bound for the cases run after the one that set it.
+  long peakRss() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  void printResult(const std::string &name, size_t size, uint64_t iterations, double ns, uint64_t allocs) {
+    printf("%s\n    {\"name\": \"%s\", \"size\": %zu, \"iterations\": %llu, \"ns_per_op\": %.1f, "
+           "\"allocs_per_op\": %.2f, \"peak_rss_kb\": %ld}",
+           is_first_result ? "" : ",", name.c_str(), size, static_cast<unsigned long long>(iterations),
+           ns / iterations, static_cast<double>(allocs) / iterations, peakRss());
+    is_first_result = false;
+    fflush(stdout);
+  }
+
+  void printSkipped(const std::string &name, size_t size, const char *reason) {
+    printf("%s\n    {\"name\": \"%s\", \"size\": %zu, \"skipped\": \"%s\"}",
+           is_first_result ? "" : ",", name.c_str(), size, reason);
+    is_first_result = false;
+  }
+
+  // Runs 'operation' (once to warm up, then for at least the minimum time)
+  // and prints its cost per call.
+  void run(const std::string &name, size_t size, const std::function<void ()> &operation) {
+    if (name.find(options.filter) == std::string::npos) return;
+    operation();
+    uint64_t iterations = 0;
+    auto allocs = allocations.load();
+    auto begin = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    auto batch = uint64_t(1);
+    while (elapsed < std::chrono::duration<double>(options.min_seconds)) {
+      for (uint64_t k = 0; k < batch; k++) operation();
+      iterations += batch;
+      elapsed = Clock::now() - begin;
+      batch *= 2;
+    }
+    allocs = allocations.load() - allocs;
+    printResult(name, size, iterations, std::chrono::duration<double, std::nano>(elapsed).count(), allocs);
+  }
+
+  // The edit patterns, applied to the collection [0, size).
+  enum Pattern { APPEND, PREPEND, RANDOM, SHUFFLE, REPLACE };
+  const char *kPatternNames[] = {"append", "prepend", "random16", "shuffle", "replace"};
+
+  // Whether the edits of 'pattern' leave most of the collection in place.
+  bool isLocal(Pattern pattern) {
+    return pattern == APPEND || pattern == PREPEND || pattern == RANDOM;
+  }
+
+  // Applies 'pattern' through the element-wise operations of 'collection'
+  // (a std::vector or a ChunkedVector).
+  template <typename Collection>
+  void edit(Collection &collection, Pattern pattern, std::mt19937 &random) {
+    auto size = collection.size();
+    auto next = static_cast<int>(size);
+    switch (pattern) {
+      case APPEND:
+        collection.push_back(next);
+        break;
+      case PREPEND:
+        collection.insert(0, next);
+        break;
+      case RANDOM:
+        // 16 insertions, deletions and substitutions at random positions.
+        for (int k = 0; k < 16; k++) {
+          auto index = static_cast<size_t>(random() % std::max<size_t>(collection.size(), 1));
+          if (k % 3 == 0 || collection.empty()) collection.insert(std::min(index, collection.size()), next++);
+          else if (k % 3 == 1) collection.erase(index);
+          else collection.set(index, next++);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // The same operations on a std::vector.
+  struct Vector {
+    std::vector<int> &v;
+    size_t size() const { return v.size(); }
+    bool empty() const { return v.empty(); }
+    void push_back(int value) { v.push_back(value); }
+    void insert(size_t index, int value) { v.insert(v.begin() + index, value); }
+    void erase(size_t index) { v.erase(v.begin() + index); }
+    void set(size_t index, int value) { v[index] = value; }
+  };
+
+  std::vector<int> edited(const std::vector<int> &x, Pattern pattern, std::mt19937 &random) {
+    auto y = x;
+    if (pattern == SHUFFLE) {
+      std::shuffle(y.begin(), y.end(), random);
+    } else if (pattern == REPLACE) {
+      for (auto &value : y) value += static_cast<int>(y.size());
+    } else {
+      auto view = Vector{y};
+      edit(view, pattern, random);
+    }
+    return y;
+  }
+
+  std::vector<int> iota(size_t size) {
+    std::vector<int> result(size);
+    for (size_t i = 0; i < size; i++) result[i] = static_cast<int>(i);
+    return result;
+  }
+
+  void benchDiff(const std::vector<size_t> &sizes) {
+    for (auto size : sizes) {
+      for (int p = APPEND; p <= REPLACE; p++) {
+        auto pattern = static_cast<Pattern>(p);
+        std::mt19937 random(42);
+        auto x = iota(size);
+        auto y = edited(x, pattern, random);
+        auto name = std::string("diff/") + kPatternNames[p];
+        if (size > kMaxTableSide) {
+          if (name.find(options.filter) != std::string::npos) printSkipped(name, size, "table too large");
+          continue;
+        }
+        run(name, size, [&]() {
+          auto diffs = buffer::diff(x, y);
+          if (diffs.empty() && pattern != SHUFFLE) abort();
+        });
+      }
+    }
+  }
+
+  void benchChunkedDiff(const std::vector<size_t> &sizes) {
+    for (auto size : sizes) {
+      for (int p = APPEND; p <= REPLACE; p++) {
+        auto pattern = static_cast<Pattern>(p);
+        auto name = std::string("chunked_diff/") + kPatternNames[p];
+        if (!isLocal(pattern) && size > kMaxTableSide) {
+          if (name.find(options.filter) != std::string::npos) printSkipped(name, size, "table too large");
+          continue;
+        }
+        std::mt19937 random(42);
+        buffer::ChunkedVector<int> x;
+        for (auto value : iota(size)) x.push_back(value);
+        buffer::ChunkedVector<int> y;
+        if (isLocal(pattern)) {
+          y = x;
+          edit(y, pattern, random);
+        } else {
+          for (auto value : edited(x.toVector(), pattern, random)) y.push_back(value);
+        }
+        run(name, size, [&]() {
+          auto diffs = buffer::diff(x, y);
+          if (diffs.empty() && pattern != SHUFFLE) abort();
+        });
+      }
+    }
+  }
+
+  class NullSubscriber: public buffer::Subscriber<int> {
+  public:
+    uint64_t changes = 0;
+    virtual void onBufferWillChange() {}
+    virtual void onBufferDidChange() {}
+    virtual void onBufferChange(buffer::DiffType, size_t, int) {
+      changes++;
+    }
+  };
+
+  // 'setCollection' alternating between two collections 16 random edits
+  // apart, until the subscribers have been notified.
+  void benchBuffer(const std::vector<size_t> &sizes) {
+    for (auto size : sizes) {
+      for (auto subscriber_count : {0, 1, 16}) {
+        for (auto is_asynchronous : {false, true}) {
+          auto name = std::string("buffer/") + (is_asynchronous ? "async" : "sync") +
+                      "/subscribers_" + std::to_string(subscriber_count);
+          std::mt19937 random(42);
+          auto x = iota(size);
+          auto y = edited(x, RANDOM, random);
+          // never destroyed: the detached worker of the last asynchronous
+          // update may still be returning from it.
+          auto &buffer = *new buffer::Buffer<int>();
+          auto &subscribers = *new std::vector<NullSubscriber>(static_cast<size_t>(subscriber_count));
+          for (auto &subscriber : subscribers) buffer.registerSubscriber(subscriber);
+          buffer.setAsynchronous(is_asynchronous);
+          auto flip = false;
+          run(name, size, [&]() {
+            auto version = buffer.getVersion();
+            buffer.setCollection((flip = !flip) ? y : x);
+            // the asynchronous updates are complete once the version moves.
+            while (buffer.getVersion() == version) std::this_thread::yield();
+          });
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc > 1) options.min_seconds = atof(argv[1]);
+  if (argc > 2) options.filter = argv[2];
+
+  auto sizes = std::vector<size_t>{10, 100, 1000, 10000, 100000, 1000000};
+  printf("{\n  \"benchmarks\": [");
+  benchDiff(sizes);
+  benchChunkedDiff(sizes);
+  benchBuffer({10, 100, 1000});
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -2,9 +2,21 @@
 #define buffer_h
 
 #include "diff.h"
+#include "queue.h"
+#include "arena.h"
+#include "pool.h"
+#include "intern.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdio.h>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
 #include <assert.h>
 
 namespace buffer {
@@ -18,6 +30,30 @@ namespace buffer {
 
     // Callback called whenever the collection changes.
     virtual void onBufferChange(DiffType type, size_t index, T value) = 0;
+
+    // Callback called (for subscribers with a viewport) in place of the changes
+    // that fall outside of the viewport, with the number of changes skipped
+    // and the number of positions the rows before the viewport moved by.
+    virtual void onBufferChangeOutsideViewport(size_t, long) {}
+
+    // Callback called in place of the changes when the subscriber has to be
+    // resynchronized, e.g. when its delivery queue dropped some updates.
+    virtual void onBufferReset(const std::vector<T> &) {}
+  };
+
+  // Interface of a consumer of whole updates (e.g. journals and transports).
+  template <typename T>
+  class UpdateListener {
+  public:
+    // Callback called once per update on the thread computing the changes.
+    // The first call after registration is a reset to the current collection.
+    virtual void onBufferUpdate(const Update<T> &update) = 0;
+  };
+
+  // The window of rows [begin, end) a subscriber is currently displaying.
+  struct Viewport {
+    size_t begin;
+    size_t end;
   };
 
   template <typename T>
@@ -25,29 +61,98 @@ namespace buffer {
   private:
 
     std::unique_ptr<std::vector<T>> back_buffer_{};
-    std::unique_ptr<std::vector<T>> front_buffer_{};
+    std::shared_ptr<const std::vector<T>> front_buffer_{};
     std::unique_ptr<std::vector<Subscriber<T>*>> subscribers_{};
-    std::__thread_id init_thread_id_ = std::this_thread::get_id();
+    std::unordered_map<Subscriber<T>*, Viewport> viewports_;
+    std::unordered_map<Subscriber<T>*, std::shared_ptr<DeliveryQueue<T>>> queues_;
+    std::unordered_map<Subscriber<T>*, uint64_t> versions_;
+    std::vector<UpdateListener<T>*> listeners_;
+    std::shared_ptr<Metrics> metrics_;
+    std::unordered_map<Subscriber<T>*, std::shared_ptr<Histogram>> callback_times_;
+
+    // the subscribers and queues of the update being dispatched, kept to
+    // reuse their memory.
+    std::vector<Subscriber<T>*> dispatched_subscribers_;
+    std::vector<std::shared_ptr<DeliveryQueue<T>>> dispatched_queues_;
+    uint64_t version_ = 0;
+    Arena scratch_;
+    VectorPool<T> pool_;
+    size_t scratch_limit_ = 1 << 24;
+    std::thread::id init_thread_id_ = std::this_thread::get_id();
     std::mutex buffer_lock_;
     std::mutex subscribers_lock_;
 
     // delegate funcs.
     std::function<bool (T, T)> compare_fnc_ = nullptr;
+    std::function<bool (const T &, const T &)> identity_fnc_ = nullptr;
     std::function<std::vector<T> (const std::vector<T> &)> sort_fnc = nullptr;
+    std::function<bool (const T &, const T &)> sort_comparator_fnc_ = nullptr;
+    std::function<uint64_t (const T &)> hash_fnc_ = nullptr;
+
+    // the hashes of the front collection (cached between updates) and of the
+    // collection being diffed against it.
+    std::vector<uint64_t> front_hashes_;
+    std::vector<uint64_t> back_hashes_;
+    bool are_hashes_valid_ = false;
+
+    // the same, for the ids of the interned elements.
+    std::shared_ptr<Interning<T>> interner_;
+    std::vector<uint32_t> front_ids_;
+    std::vector<uint32_t> back_ids_;
+    bool are_ids_valid_ = false;
+    uint64_t ids_generation_ = 0;
+
+    // the same, for the keys and versions of the elements.
+    std::function<uint64_t (const T &)> key_fnc_ = nullptr;
+    std::function<uint64_t (const T &)> version_fnc_ = nullptr;
+    std::vector<std::pair<uint64_t, uint64_t>> front_stamps_;
+    std::vector<std::pair<uint64_t, uint64_t>> back_stamps_;
+    bool are_stamps_valid_ = false;
 
     // flags.
     bool is_asynchronous_ = false;
+    bool is_streaming_ = false;
     bool is_computing_changes_ = false;
     bool should_recompute_changes_ = false;
 
+    // A script in the scratch memory.
+    typedef std::vector<Diff<T>, ArenaAllocator<Diff<T>>> Script;
+
+    // The time spent in the callbacks of each synchronous subscriber during
+    // an update, with the histograms it goes to (none when not measured).
+    struct Timings {
+      std::vector<std::shared_ptr<Histogram>> histograms;
+      std::vector<uint64_t> times;
+
+      // Records the times and returns their sum.
+      uint64_t record() {
+        uint64_t total = 0;
+        for (size_t k = 0; k < times.size(); k++) {
+          histograms[k]->record(times[k]);
+          total += times[k];
+        }
+        return total;
+      }
+    };
+
   public:
 
     Buffer() {
       back_buffer_ = std::unique_ptr<std::vector<T>>(new std::vector<T>());
-      front_buffer_ = std::unique_ptr<std::vector<T>>(new std::vector<T>());
+      front_buffer_ = std::shared_ptr<const std::vector<T>>(new std::vector<T>());
       subscribers_ = std::unique_ptr<std::vector<Subscriber<T>*>>(new std::vector<Subscriber<T>*>());
     }
 
+    ~Buffer() {
+      // the queues must not deliver to this buffer once it is gone.
+      subscribers_lock_.lock();
+      auto queues = queues_;
+      queues_.clear();
+      subscribers_lock_.unlock();
+      for (auto &queue : queues)
+        queue.second->close();
+    }
+
     // Adds a new subscriber to this buffer.
     void registerSubscriber(Subscriber<T> &subscriber) {
       subscribers_lock_.lock();
@@ -61,35 +166,126 @@ namespace buffer {
       }
     }
 
+    // Adds a new subscriber whose changes are delivered through 'queue' rather
+    // than on the thread computing the diffs.
+    void registerSubscriber(Subscriber<T> &subscriber, std::shared_ptr<DeliveryQueue<T>> queue) {
+      subscribers_lock_.lock();
+      auto &entry = queues_[&subscriber];
+      auto replaced = entry != queue ? entry : nullptr;
+      entry = queue;
+      subscribers_lock_.unlock();
+      // the queue replaced stops delivering.
+      if (replaced) replaced->close();
+      auto target = &subscriber;
+      queue->start([this, target](const Update<T> &update) {
+        deliver(target, update);
+      });
+      registerSubscriber(subscriber);
+    }
+
     // Remove the subscriber passed as argument.
     void unregisterSubscriber(Subscriber<T> &subscriber) {
       subscribers_lock_.lock();
-      auto v = subscribers_;
-      if(std::find(v->begin(), v->end(), &subscriber) != v->end())
+      auto &v = *subscribers_;
+      if(std::find(v.begin(), v.end(), &subscriber) != v.end())
         // Remove the subscriber at the found position.
         v.erase(std::remove(v.begin(), v.end(), &subscriber), v.end());
+      viewports_.erase(&subscriber);
+      versions_.erase(&subscriber);
+      callback_times_.erase(&subscriber);
+      auto it = queues_.find(&subscriber);
+      auto queue = it != queues_.end() ? it->second : nullptr;
+      if (queue) queues_.erase(it);
+      subscribers_lock_.unlock();
+      // waits for the delivery in flight, outside of the lock it may need.
+      if (queue) queue->close();
+    }
+
+    // Adds a listener that receives every update as a whole.
+    void addUpdateListener(UpdateListener<T> &listener) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      if (std::find(listeners_.begin(), listeners_.end(), &listener) != listeners_.end()) return;
+      listeners_.push_back(&listener);
+      listener.onBufferUpdate(Update<T>{version_, nullptr, std::atomic_load(&front_buffer_)});
+    }
+
+    void removeUpdateListener(UpdateListener<T> &listener) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      listeners_.erase(std::remove(listeners_.begin(), listeners_.end(), &listener), listeners_.end());
+    }
+
+    // Restricts the per-row changes delivered to 'subscriber' to the rows in
+    // [begin, end); the changes outside of it are summarized through
+    // 'onBufferChangeOutsideViewport'. The viewport follows its rows when
+    // changes before it shift them, and can be moved again at any time.
+    void setViewport(Subscriber<T> &subscriber, size_t begin, size_t end) {
+      assert(begin <= end);
+      subscribers_lock_.lock();
+      viewports_[&subscriber] = Viewport{begin, end};
+      subscribers_lock_.unlock();
+    }
+
+    // The subscriber passed as argument receives every change again.
+    void clearViewport(Subscriber<T> &subscriber) {
+      subscribers_lock_.lock();
+      viewports_.erase(&subscriber);
       subscribers_lock_.unlock();
     }
 
     // Returns all the element currently exposed from the buffer.
     std::vector<T> getCollection() {
-      std::vector<T> result(front_buffer_);
+      std::vector<T> result(*std::atomic_load(&front_buffer_));
       return result;
     }
 
     // Updates the collection, compute the diffs and notifies the subscribers.
     void setCollection(std::vector<T> collection) {
       assert(init_thread_id_ == std::this_thread::get_id());
-      back_buffer_ = std::unique_ptr<std::vector<T>>(new std::vector<T>(collection));
+      *back_buffer_ = std::move(collection);
       refresh();
     }
 
+    // Replaces the collection (and its version) without computing the changes,
+    // e.g. when restoring a persisted state. Everyone is notified with a reset.
+    void restoreCollection(std::vector<T> collection, uint64_t version) {
+      assert(init_thread_id_ == std::this_thread::get_id());
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      back_buffer_ = std::unique_ptr<std::vector<T>>(new std::vector<T>(collection));
+      std::atomic_store(&front_buffer_, std::shared_ptr<const std::vector<T>>(new std::vector<T>(std::move(collection))));
+      invalidateCaches();
+
+      subscribers_lock_.lock();
+      version_ = version;
+      auto subscribers = *subscribers_;
+      auto queues = queues_;
+      for (auto subscriber : subscribers)
+        if (!queues.count(subscriber)) versions_[subscriber] = version_;
+      subscribers_lock_.unlock();
+
+      auto update = Update<T>{version_, nullptr, std::atomic_load(&front_buffer_)};
+      for (auto subscriber : subscribers) {
+        auto it = queues.find(subscriber);
+        if (it != queues.end()) {
+          it->second->push(update);
+        } else {
+          subscriber->onBufferWillChange();
+          subscriber->onBufferReset(*update.collection);
+          subscriber->onBufferDidChange();
+        }
+      }
+      for (auto listener : listeners_)
+        listener->onBufferUpdate(update);
+    }
+
     void refresh() {
+      BUFFER_TRACE_SCOPE("refresh");
       if (!is_asynchronous_) {
         computeChanges();
       } else {
         // check if is already applying the changes.
         if (is_computing_changes_) {
+          auto metrics = std::atomic_load(&metrics_);
+          if (metrics && should_recompute_changes_) metrics->coalesced++;
           should_recompute_changes_ = true;
           return;
         }
@@ -98,51 +294,178 @@ namespace buffer {
       }
     }
 
+    // The version of the collection, incremented by every update that changes it.
+    uint64_t getVersion() {
+      std::lock_guard<std::mutex> lock(subscribers_lock_);
+      return version_;
+    }
+
+    // The version of the collection last delivered to 'subscriber'.
+    uint64_t getVersion(Subscriber<T> &subscriber) {
+      std::lock_guard<std::mutex> lock(subscribers_lock_);
+      auto it = versions_.find(&subscriber);
+      return it != versions_.end() ? it->second : 0;
+    }
+
     // Wheter the changes should be computed on a background thread or not.
     void setAsynchronous(bool asynchronous) {
       is_asynchronous_ = asynchronous;
     }
 
-    // Override the '==' function for the collection wrapped.
+    // Whether the changes should be delivered to the subscribers while the
+    // diff is being traced back, without building the edit script first.
+    // Only applies to the updates that no queue, listener or viewport needs
+    // as a whole, with no function loosening the comparison (whose kept
+    // elements are only known from the script); the others keep going
+    // through the script.
+    void setStreaming(bool streaming) {
+      is_streaming_ = streaming;
+    }
+
+    // The memory kept between updates for the scratch data of the diff (the
+    // memoization table); the updates whose table fits in it allocate nothing.
+    void setScratchLimit(size_t bytes) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      scratch_limit_ = bytes;
+    }
+
+    // Override the '==' function for the collection wrapped. It decides
+    // whether the content of an element changed. The elements it deems equal
+    // to the previous ones keep their previous value in the collection (the
+    // same goes for the identity function, the interner and the version
+    // functions), so that applying the updates always rebuilds the collection.
     void setCompareFunction(const std::function<bool (T, T)> compare) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
       compare_fnc_ = compare;
     }
 
+    // Function telling whether two elements are the same item (e.g. they have
+    // the same id), whatever their content. The diffs then align the items by
+    // identity and only compare the content (with the compare function) of
+    // the items present on both sides: an item whose content changed is
+    // reported as a substitution. Takes precedence over the interner and the
+    // hash function, which would otherwise compare the content.
+    void setIdentityFunction(const std::function<bool (const T &, const T &)> identity) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      identity_fnc_ = identity;
+      invalidateCaches();
+    }
+
+    // Hash function used to compare the elements by hash first while
+    // computing the diffs: worth it when comparing elements is expensive
+    // (e.g. strings or large structs). Equal elements must have equal hashes.
+    // The hashes of a collection are computed once and kept with it.
+    void setHashFunction(const std::function<uint64_t (const T &)> hash) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      hash_fnc_ = hash;
+      invalidateCaches();
+    }
+
+    // Interner mapping the elements to integer ids before computing the diffs,
+    // e.g. an 'Interner<T>': the diffs then compare integers, and the ids of a
+    // collection are kept with it. The interner's equality replaces the
+    // compare function. Takes precedence over the hash function.
+    // An interner can be shared by buffers updated on the same thread (it is
+    // not synchronized), e.g. to intern the common elements once.
+    void setInterner(std::shared_ptr<Interning<T>> interner) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      interner_ = interner;
+      invalidateCaches();
+    }
+
+    // Functions extracting the key and the version of an element, for rows
+    // carrying a version (or generation) counter: two elements with the same
+    // key and version are then known to be equal without comparing them, and
+    // an element whose version changed is reported as a substitution. Takes
+    // precedence over the identity function, the interner and the hash
+    // function.
+    void setVersionFunctions(const std::function<uint64_t (const T &)> key,
+                             const std::function<uint64_t (const T &)> version) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      key_fnc_ = key;
+      version_fnc_ = version;
+      invalidateCaches();
+    }
+
+    // Records the latencies and the sizes of the updates into 'metrics' (which
+    // can be shared by several buffers), or stops recording them when null.
+    // Scraping the metrics never blocks the updates.
+    void setMetrics(std::shared_ptr<Metrics> metrics) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      std::lock_guard<std::mutex> subscribers_lock(subscribers_lock_);
+      std::atomic_store(&metrics_, metrics);
+      callback_times_.clear();
+    }
+
     // Sort function applied to the collection everytime is updated.
     void setSortFunction(const std::function<std::vector<T> (const std::vector<T> &)> sort) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
       sort_fnc = sort;
     }
 
+    // Order the collection is (stably) sorted in everytime is updated. Unlike
+    // the sort function it sorts in place, in memory reused between updates.
+    // Takes precedence over the sort function.
+    void setSortComparator(const std::function<bool (const T &, const T &)> comparator) {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      sort_comparator_fnc_ = comparator;
+    }
+
   private:
 
     void computeChanges() {
+      BUFFER_TRACE_SCOPE("computeChanges");
       buffer_lock_.lock();
       is_computing_changes_ = true;
       if (should_recompute_changes_)
         should_recompute_changes_ = false;
 
-      const auto new_collection = sort_fnc
-          ? new std::vector<T>(sort_fnc(std::vector<T>(*back_buffer_)))
-          : new std::vector<T>(*back_buffer_);
-
-      auto diffs = diff(*front_buffer_, *new_collection);
-      auto is_changed = diffs.size();
+      // the phases are only timed when the metrics are enabled.
+      auto metrics = std::atomic_load(&metrics_);
+      auto mark = metrics ? Metrics::Clock::now() : Metrics::Clock::time_point();
 
-      if (is_changed)
-        for (auto subscriber : *subscribers_)
-          subscriber->onBufferWillChange();
-
-      front_buffer_ = std::unique_ptr<std::vector<T>>(std::move(new_collection));
+      // the new collection reuses the memory of a retired one.
+      auto new_collection = pool_.acquire();
+      if (sort_comparator_fnc_) {
+        BUFFER_TRACE_SCOPE("sort");
+        new_collection->assign(back_buffer_->begin(), back_buffer_->end());
+        std::stable_sort(new_collection->begin(), new_collection->end(), sort_comparator_fnc_);
+      } else if (sort_fnc) {
+        BUFFER_TRACE_SCOPE("sort");
+        // moved rather than assigned, which would free the recycled memory.
+        auto sorted = sort_fnc(*back_buffer_);
+        new_collection->assign(std::make_move_iterator(sorted.begin()), std::make_move_iterator(sorted.end()));
+      } else {
+        new_collection->assign(back_buffer_->begin(), back_buffer_->end());
+      }
+      if (metrics) metrics->sort.record(Metrics::lap(mark));
 
-      // Propagate the event change to all of the subscribers;
-      for (auto diff : diffs)
-        for (auto subscriber : *subscribers_)
-          subscriber->onBufferChange(diff.type, diff.index, diff.value);
+      subscribers_lock_.lock();
+      auto &subscribers = dispatched_subscribers_;
+      auto &queues = dispatched_queues_;
+      subscribers.clear();
+      queues.clear();
+      for (auto subscriber : *subscribers_) {
+        auto it = queues_.find(subscriber);
+        if (it == queues_.end()) subscribers.push_back(subscriber);
+        else queues.push_back(it->second);
+      }
+      auto has_viewports = !viewports_.empty();
+      auto timings = Timings();
+      if (metrics)
+        for (auto subscriber : subscribers)
+          timings.histograms.push_back(callbackTime(subscriber, metrics));
+      timings.times.resize(timings.histograms.size());
+      subscribers_lock_.unlock();
 
-      if (is_changed)
-        for (auto subscriber : *subscribers_)
-          subscriber->onBufferDidChange();
+      if (is_streaming_ && queues.empty() && listeners_.empty() && !has_viewports && !isLoose())
+        stream(subscribers, std::move(new_collection), metrics, timings, mark);
+      else
+        applyChanges(subscribers, queues, has_viewports, std::move(new_collection), metrics, timings, mark);
 
+      // the script and the table lived in the scratch memory.
+      trimScratch();
+      queues.clear();
       is_computing_changes_ = false;
       buffer_lock_.unlock();
 
@@ -150,6 +473,385 @@ namespace buffer {
       if (should_recompute_changes_)
         computeChanges();
     }
+
+    // Computes the changes to 'new_collection', publishes it and notifies
+    // everyone. Must be called with 'buffer_lock_' held.
+    void applyChanges(const std::vector<Subscriber<T>*> &subscribers,
+                      const std::vector<std::shared_ptr<DeliveryQueue<T>>> &queues,
+                      bool has_viewports,
+                      std::unique_ptr<std::vector<T>> new_collection,
+                      const std::shared_ptr<Metrics> &metrics,
+                      Timings &timings,
+                      Metrics::Clock::time_point &mark) {
+      auto diffs = computeDiff(*front_buffer_, *new_collection);
+      // nothing changed: the front collection stays, even where the
+      // comparison matched elements that differ.
+      if (diffs.empty()) {
+        pool_.recycle(std::move(new_collection));
+        if (metrics) metrics->diff.record(Metrics::lap(mark));
+        return;
+      }
+      if (isLoose())
+        keepMatches(*front_buffer_, *new_collection, diffs);
+      if (metrics) metrics->diff.record(Metrics::lap(mark));
+
+      each(subscribers, timings, [](Subscriber<T> *subscriber) {
+        subscriber->onBufferWillChange();
+      });
+
+      std::atomic_store(&front_buffer_, pool_.share(std::move(new_collection)));
+      if (metrics) metrics->publish.record(Metrics::lap(mark));
+
+      // Propagate the event change to all of the subscribers;
+      {
+        BUFFER_TRACE_SCOPE("dispatch");
+        if (!has_viewports) {
+          for (auto &diff : diffs)
+            each(subscribers, timings, [&diff](Subscriber<T> *subscriber) {
+              subscriber->onBufferChange(diff.type, diff.index, diff.value);
+            });
+        } else {
+          auto shifts = viewportShifts(diffs);
+          each(subscribers, timings, [&](Subscriber<T> *subscriber) {
+            notify(subscriber, diffs, shifts);
+          });
+        }
+      }
+
+      each(subscribers, timings, [](Subscriber<T> *subscriber) {
+        subscriber->onBufferDidChange();
+      });
+      if (metrics) {
+        metrics->dispatch.record(Metrics::lap(mark));
+        timings.record();
+      }
+
+      subscribers_lock_.lock();
+      ++version_;
+      for (auto subscriber : subscribers)
+        versions_[subscriber] = version_;
+      subscribers_lock_.unlock();
+      if (metrics) {
+        metrics->updates++;
+        metrics->edits.record(diffs.size());
+      }
+
+      // The queued subscribers and the listeners share the same update, with
+      // a copy of the script that outlives the scratch memory.
+      if (!queues.empty() || !listeners_.empty()) {
+        BUFFER_TRACE_SCOPE("listeners");
+        auto update = Update<T>{version_,
+                                std::make_shared<const std::vector<Diff<T>>>(diffs.begin(), diffs.end()),
+                                std::atomic_load(&front_buffer_)};
+        for (auto listener : listeners_)
+          listener->onBufferUpdate(update);
+        for (auto &queue : queues) {
+          queue->push(update);
+          if (metrics) metrics->queue_depth.record(queue->size());
+        }
+        if (metrics) metrics->listeners.record(Metrics::lap(mark));
+      }
+    }
+
+    // Computes the script with the memoization table drawn from 'scratch_',
+    // like the script itself: it must be gone before 'trimScratch'.
+    // Must be called with 'buffer_lock_' held.
+    Script computeDiff(const std::vector<T> &x, const std::vector<T> &y) {
+      Script list{ArenaAllocator<Diff<T>>(scratch_)};
+      visitChanges(x, y, [&list](DiffType type, size_t index, const T &value, const T &previous) {
+        list.push_back(Diff<T>{type, index, value, type == INSERT ? value : previous});
+      });
+      return list;
+    }
+
+    // Walks the changes from 'x' to 'y' comparing the interned ids, the hashes
+    // or the elements themselves, whichever is available.
+    // Must be called with 'buffer_lock_' held.
+    template <typename Visitor>
+    void visitChanges(const std::vector<T> &x, const std::vector<T> &y, Visitor &&visitor) {
+      BUFFER_TRACE_SCOPE("visitChanges");
+      auto edit = [&](DiffType type, size_t i, size_t j) {
+        if (type == DELETE) visitor(type, i, x[i], x[i]);
+        else visitor(type, i, y[j], type == INSERT ? y[j] : x[i]);
+      };
+      auto are_stamps_valid = false, are_ids_valid = false, are_hashes_valid = false;
+      if (key_fnc_ && version_fnc_) {
+        stamp(x, y);
+        auto x_stamps = front_stamps_.data();
+        auto y_stamps = back_stamps_.data();
+        // elements with the same key are the same element: kept as they are
+        // when their version did not change, substituted otherwise.
+        diffIndices(x.size(), y.size(), [x_stamps, y_stamps](size_t i, size_t j) {
+          return x_stamps[i].first == y_stamps[j].first;
+        }, edit, [&](size_t i, size_t j) {
+          if (x_stamps[i].second != y_stamps[j].second) edit(SUBSTITUTE, i, j);
+        }, ArenaAllocator<int>(scratch_));
+        front_stamps_.swap(back_stamps_);
+        are_stamps_valid = true;
+      } else if (identity_fnc_) {
+        // the costly content comparison only runs on the pairs of elements
+        // the diff keeps.
+        diffIndices(x.size(), y.size(), [&](size_t i, size_t j) {
+          return identity_fnc_(x[i], y[j]);
+        }, edit, [&](size_t i, size_t j) {
+          if (!isEqual(x[i], y[j])) edit(SUBSTITUTE, i, j);
+        }, ArenaAllocator<int>(scratch_));
+      } else if (interner_) {
+        intern(x, y);
+        auto x_ids = front_ids_.data();
+        auto y_ids = back_ids_.data();
+        diffIndices(x.size(), y.size(), [x_ids, y_ids](size_t i, size_t j) {
+          return x_ids[i] == y_ids[j];
+        }, edit, [](size_t, size_t) {}, ArenaAllocator<int>(scratch_));
+        front_ids_.swap(back_ids_);
+        are_ids_valid = true;
+      } else {
+        auto is_hashed = hash(x, y);
+        diffVisitHashed(x, y, is_hashed ? front_hashes_.data() : nullptr, is_hashed ? back_hashes_.data() : nullptr,
+                        compare_fnc_, visitor, ArenaAllocator<int>(scratch_));
+        front_hashes_.swap(back_hashes_);
+        are_hashes_valid = is_hashed;
+      }
+      // only the cache of the path taken follows the front collection.
+      are_stamps_valid_ = are_stamps_valid;
+      are_ids_valid_ = are_ids_valid;
+      are_hashes_valid_ = are_hashes_valid;
+    }
+
+    // Drops the cached hashes, ids and stamps of the front collection, e.g.
+    // when switching the path computing the diffs.
+    void invalidateCaches() {
+      are_hashes_valid_ = false;
+      are_ids_valid_ = false;
+      are_stamps_valid_ = false;
+    }
+
+    // Extracts the keys and versions of the new collection 'y' and, unless
+    // they are cached, of the front collection 'x'.
+    void stamp(const std::vector<T> &x, const std::vector<T> &y) {
+      if (!are_stamps_valid_) {
+        front_stamps_.resize(x.size());
+        for (size_t i = 0; i < x.size(); i++) front_stamps_[i] = std::make_pair(key_fnc_(x[i]), version_fnc_(x[i]));
+      }
+      back_stamps_.resize(y.size());
+      for (size_t i = 0; i < y.size(); i++) back_stamps_[i] = std::make_pair(key_fnc_(y[i]), version_fnc_(y[i]));
+    }
+
+    // Whether the diff may keep elements that are not '==' to the new ones
+    // (a compare or identity function, an interner or version stamps).
+    bool isLoose() const {
+      return compare_fnc_ || identity_fnc_ || interner_ || (key_fnc_ && version_fnc_);
+    }
+
+    // Puts back into 'y' the elements of 'x' the diff kept, so that 'diffs'
+    // turns 'x' into exactly 'y' even when the comparison matched elements
+    // that differ. Walks the script in ascending order of index.
+    template <typename Diffs>
+    static void keepMatches(const std::vector<T> &x, std::vector<T> &y, const Diffs &diffs) {
+      size_t i = 0, j = 0;
+      for (auto diff = diffs.rbegin(); diff != diffs.rend(); ++diff) {
+        while (i < diff->index) y[j++] = x[i++];
+        if (diff->type != DELETE) j++;
+        if (diff->type != INSERT) i++;
+      }
+      while (i < x.size()) y[j++] = x[i++];
+    }
+
+    // Whether the content of two elements is the same.
+    bool isEqual(const T &a, const T &b) const {
+      return compare_fnc_ ? compare_fnc_(a, b) : a == b;
+    }
+
+    // Whether the two collections are equal, by the same criteria as the diff.
+    bool isUnchanged(const std::vector<T> &x, const std::vector<T> &y) {
+      if (x.size() != y.size()) return false;
+      auto has_stamps = key_fnc_ && version_fnc_;
+      for (size_t i = 0; i < x.size(); i++) {
+        auto is_same = has_stamps
+            ? key_fnc_(x[i]) == key_fnc_(y[i]) && version_fnc_(x[i]) == version_fnc_(y[i])
+            : (!identity_fnc_ || identity_fnc_(x[i], y[i])) && isEqual(x[i], y[i]);
+        if (!is_same) return false;
+      }
+      return true;
+    }
+
+    // Interns the new collection 'y' and, unless its ids are cached, the front
+    // collection 'x'. The interner is cleared when it grows much larger than
+    // the collections, i.e. when it mostly holds elements long gone; the ids
+    // cached before a clear (by any of the buffers sharing the interner) are
+    // recomputed.
+    void intern(const std::vector<T> &x, const std::vector<T> &y) {
+      if (interner_->size() > 4 * (x.size() + y.size()) + 1024) interner_->clear();
+      if (!are_ids_valid_ || ids_generation_ != interner_->generation()) interner_->intern(x, front_ids_);
+      interner_->intern(y, back_ids_);
+      ids_generation_ = interner_->generation();
+    }
+
+    // Hashes the new collection 'y' and, unless its hashes are cached, the
+    // front collection 'x'. Returns false when there is no hash function.
+    bool hash(const std::vector<T> &x, const std::vector<T> &y) {
+      if (!hash_fnc_) return false;
+      if (!are_hashes_valid_) {
+        front_hashes_.resize(x.size());
+        for (size_t i = 0; i < x.size(); i++) front_hashes_[i] = hash_fnc_(x[i]);
+      }
+      back_hashes_.resize(y.size());
+      for (size_t i = 0; i < y.size(); i++) back_hashes_[i] = hash_fnc_(y[i]);
+      return true;
+    }
+
+    // Recycles the scratch memory for the next update, or frees it when an
+    // unusually large diff grew it past the limit.
+    void trimScratch() {
+      if (scratch_.capacity() > scratch_limit_) scratch_.release();
+      else scratch_.reset();
+    }
+
+    // Delivers the changes to the synchronous subscribers as the traceback
+    // finds them. Must be called with 'buffer_lock_' held.
+    // The time the traceback spends in the subscribers counts as dispatch,
+    // the rest as diff.
+    void stream(const std::vector<Subscriber<T>*> &subscribers, std::unique_ptr<std::vector<T>> new_collection,
+                const std::shared_ptr<Metrics> &metrics, Timings &timings, Metrics::Clock::time_point &mark) {
+      BUFFER_TRACE_SCOPE("stream");
+      auto previous = std::atomic_load(&front_buffer_);
+      auto &x = *previous;
+      auto &y = *new_collection;
+      if (isUnchanged(x, y)) {
+        pool_.recycle(std::move(new_collection));
+        if (metrics) metrics->diff.record(Metrics::lap(mark));
+        return;
+      }
+
+      each(subscribers, timings, [](Subscriber<T> *subscriber) {
+        subscriber->onBufferWillChange();
+      });
+      std::atomic_store(&front_buffer_, pool_.share(std::move(new_collection)));
+      if (metrics) metrics->publish.record(Metrics::lap(mark));
+      size_t edits = 0;
+      visitChanges(x, y, [&](DiffType type, size_t index, const T &value, const T &) {
+        edits++;
+        each(subscribers, timings, [&](Subscriber<T> *subscriber) {
+          subscriber->onBufferChange(type, index, value);
+        });
+      });
+      each(subscribers, timings, [](Subscriber<T> *subscriber) {
+        subscriber->onBufferDidChange();
+      });
+
+      if (metrics) {
+        auto dispatch = timings.record();
+        auto elapsed = Metrics::lap(mark);
+        metrics->diff.record(elapsed > dispatch ? elapsed - dispatch : 0);
+        metrics->dispatch.record(dispatch);
+        metrics->edits.record(edits);
+        metrics->updates++;
+      }
+
+      subscribers_lock_.lock();
+      ++version_;
+      for (auto subscriber : subscribers)
+        versions_[subscriber] = version_;
+      subscribers_lock_.unlock();
+    }
+
+    // Delivers an update to a queued subscriber.
+    void deliver(Subscriber<T> *subscriber, const Update<T> &update) {
+      BUFFER_TRACE_SCOPE("deliver");
+      auto metrics = std::atomic_load(&metrics_);
+      auto mark = metrics ? Metrics::Clock::now() : Metrics::Clock::time_point();
+      subscriber->onBufferWillChange();
+      if (!update.diffs) {
+        subscriber->onBufferReset(*update.collection);
+      } else {
+        subscribers_lock_.lock();
+        auto has_viewport = viewports_.count(subscriber);
+        subscribers_lock_.unlock();
+        notify(subscriber, *update.diffs, has_viewport ? viewportShifts(*update.diffs) : std::vector<long>());
+      }
+      subscriber->onBufferDidChange();
+      subscribers_lock_.lock();
+      versions_[subscriber] = update.version;
+      auto histogram = metrics ? callbackTime(subscriber, metrics) : nullptr;
+      subscribers_lock_.unlock();
+      if (histogram) histogram->record(Metrics::lap(mark));
+    }
+
+    // Calls 'callback' on every subscriber, timing the calls if measured.
+    template <typename Callback>
+    static void each(const std::vector<Subscriber<T>*> &subscribers, Timings &timings, Callback &&callback) {
+      if (timings.times.empty()) {
+        for (auto subscriber : subscribers) callback(subscriber);
+        return;
+      }
+      auto mark = Metrics::Clock::now();
+      for (size_t k = 0; k < subscribers.size(); k++) {
+        callback(subscribers[k]);
+        timings.times[k] += Metrics::lap(mark);
+      }
+    }
+
+    // The histogram of the callback times of 'subscriber', looked up in
+    // 'metrics' only once. Must be called with 'subscribers_lock_' held.
+    std::shared_ptr<Histogram> callbackTime(Subscriber<T> *subscriber, const std::shared_ptr<Metrics> &metrics) {
+      // 'metrics' may have just been replaced.
+      if (metrics != std::atomic_load(&metrics_)) return metrics->subscriber(subscriber);
+      auto &histogram = callback_times_[subscriber];
+      if (!histogram) histogram = metrics->subscriber(subscriber);
+      return histogram;
+    }
+
+    // 'shifts[k]' is the net number of rows inserted by the diffs from 'k' on.
+    // Since the indices are non-increasing those are the diffs preceding a row.
+    template <typename Diffs>
+    static std::vector<long> viewportShifts(const Diffs &diffs) {
+      std::vector<long> shifts(diffs.size() + 1, 0);
+      for (auto k = diffs.size(); k-- > 0;)
+        shifts[k] = shifts[k+1] + (diffs[k].type == INSERT ? 1 : diffs[k].type == DELETE ? -1 : 0);
+      return shifts;
+    }
+
+    // Delivers the changes to a subscriber, restricting them to its viewport
+    // if it has one.
+    template <typename Diffs>
+    void notify(Subscriber<T> *subscriber, const Diffs &diffs, const std::vector<long> &shifts) {
+      BUFFER_TRACE_SCOPE("notify");
+      subscribers_lock_.lock();
+      auto it = viewports_.find(subscriber);
+      auto has_viewport = it != viewports_.end();
+      auto viewport = has_viewport ? it->second : Viewport{0, 0};
+      subscribers_lock_.unlock();
+
+      if (!has_viewport) {
+        for (auto &diff : diffs)
+          subscriber->onBufferChange(diff.type, diff.index, diff.value);
+        return;
+      }
+
+      // [first, last) are the diffs inside the viewport.
+      auto first = std::partition_point(diffs.begin(), diffs.end(), [&](const Diff<T> &d) {
+        return d.index >= viewport.end;
+      });
+      auto last = std::partition_point(first, diffs.end(), [&](const Diff<T> &d) {
+        return d.index >= viewport.begin;
+      });
+      for (auto diff = first; diff != last; ++diff)
+        subscriber->onBufferChange(diff->type, diff->index, diff->value);
+
+      auto skipped = diffs.size() - static_cast<size_t>(last - first);
+      auto shift = shifts[static_cast<size_t>(last - diffs.begin())];
+      if (skipped)
+        subscriber->onBufferChangeOutsideViewport(skipped, shift);
+
+      // the viewport keeps pointing at the same rows.
+      subscribers_lock_.lock();
+      it = viewports_.find(subscriber);
+      if (it != viewports_.end() && shift) {
+        it->second.begin = static_cast<size_t>(std::max(0l, static_cast<long>(it->second.begin) + shift));
+        it->second.end = static_cast<size_t>(std::max(0l, static_cast<long>(it->second.end) + shift));
+      }
+      subscribers_lock_.unlock();
+    }
   };
 }
 
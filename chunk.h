@@ -0,0 +1,249 @@
+#ifndef chunk_h
+#define chunk_h
+
+#include "diff.h"
+#include "script.h"
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <assert.h>
+
+namespace buffer {
+
+  // A vector stored as a list of immutable, reference counted chunks.
+  // Copies share all of their chunks and every write clones only the chunk it
+  // targets, so successive versions of a collection share the unchanged regions.
+  template <typename T>
+  class ChunkedVector {
+  public:
+    typedef std::shared_ptr<const std::vector<T>> Chunk;
+
+  private:
+    std::vector<Chunk> chunks_;
+    std::vector<size_t> offsets_;   // Index of the first element of every chunk.
+    size_t size_ = 0;
+    size_t chunk_size_;
+
+  public:
+
+    explicit ChunkedVector(size_t chunk_size = 64): chunk_size_(chunk_size) {
+      assert(chunk_size > 0);
+    }
+
+    ChunkedVector(const std::vector<T> &collection, size_t chunk_size = 64): chunk_size_(chunk_size) {
+      assert(chunk_size > 0);
+      for (size_t i = 0; i < collection.size(); i += chunk_size_) {
+        auto end = std::min(collection.size(), i + chunk_size_);
+        chunks_.push_back(Chunk(new std::vector<T>(collection.begin() + i, collection.begin() + end)));
+      }
+      reindex();
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    // The chunks backing this vector, in order.
+    const std::vector<Chunk> &chunks() const {
+      return chunks_;
+    }
+
+    // Index of the first element of the chunk at 'chunk_index'.
+    size_t chunkOffset(size_t chunk_index) const {
+      return chunk_index < offsets_.size() ? offsets_[chunk_index] : size_;
+    }
+
+    const T &operator[](size_t index) const {
+      auto c = locate(index);
+      return (*chunks_[c])[index - offsets_[c]];
+    }
+
+    // Replaces the element at 'index', cloning the chunk that holds it.
+    void set(size_t index, const T &value) {
+      auto c = locate(index);
+      auto chunk = new std::vector<T>(*chunks_[c]);
+      (*chunk)[index - offsets_[c]] = value;
+      chunks_[c] = Chunk(chunk);
+    }
+
+    // Inserts 'value' at 'index', splitting the target chunk when it grows past
+    // twice the nominal chunk size.
+    void insert(size_t index, const T &value) {
+      assert(index <= size_);
+      if (chunks_.empty()) {
+        chunks_.push_back(Chunk(new std::vector<T>(1, value)));
+        reindex();
+        return;
+      }
+      // appending goes to the last chunk.
+      auto c = index == size_ ? chunks_.size() - 1 : locate(index);
+      auto chunk = std::vector<T>(*chunks_[c]);
+      chunk.insert(chunk.begin() + (index - offsets_[c]), value);
+      if (chunk.size() >= 2 * chunk_size_) {
+        auto half = chunk.size() / 2;
+        chunks_[c] = Chunk(new std::vector<T>(chunk.begin(), chunk.begin() + half));
+        chunks_.insert(chunks_.begin() + c + 1, Chunk(new std::vector<T>(chunk.begin() + half, chunk.end())));
+      } else {
+        chunks_[c] = Chunk(new std::vector<T>(std::move(chunk)));
+      }
+      reindex();
+    }
+
+    // Removes the element at 'index', dropping the chunk when it becomes empty.
+    void erase(size_t index) {
+      auto c = locate(index);
+      if (chunks_[c]->size() == 1) {
+        chunks_.erase(chunks_.begin() + c);
+      } else {
+        auto chunk = new std::vector<T>(*chunks_[c]);
+        chunk->erase(chunk->begin() + (index - offsets_[c]));
+        chunks_[c] = Chunk(chunk);
+      }
+      reindex();
+    }
+
+    void push_back(const T &value) {
+      insert(size_, value);
+    }
+
+    // Applies a canonical script (see script.h), cloning every edited chunk
+    // once and sharing all the others with the previous version.
+    void apply(const std::vector<Diff<T>> &diffs) {
+      if (diffs.empty()) return;
+      std::vector<Chunk> chunks;
+      std::vector<Diff<T>> edits;
+      auto d = diffs.rbegin();
+      for (size_t c = 0; c < std::max<size_t>(chunks_.size(), 1); c++) {
+        auto begin = chunkOffset(c);
+        auto is_last = c + 1 >= chunks_.size();
+        auto end = is_last ? size_ + 1 : chunkOffset(c + 1);
+        // the edits of this chunk, in ascending order.
+        edits.clear();
+        for (; d != diffs.rend() && d->index < end; ++d) {
+          edits.push_back(*d);
+          edits.back().index -= begin;
+        }
+        if (edits.empty()) {
+          chunks.push_back(chunks_[c]);
+          continue;
+        }
+        std::reverse(edits.begin(), edits.end());
+        auto chunk = c < chunks_.size() ? *chunks_[c] : std::vector<T>();
+        buffer::apply(chunk, edits);
+        // splits the chunks that grew too large.
+        for (size_t i = 0; i < chunk.size();) {
+          auto last = chunk.size() - i < 2 * chunk_size_ ? chunk.size() : i + chunk_size_;
+          chunks.push_back(Chunk(new std::vector<T>(chunk.begin() + i, chunk.begin() + last)));
+          i = last;
+        }
+      }
+      assert(d == diffs.rend());
+      chunks_.swap(chunks);
+      reindex();
+    }
+
+    // Copies the elements in the range [begin, end) into a contiguous vector.
+    std::vector<T> slice(size_t begin, size_t end) const {
+      std::vector<T> result;
+      result.reserve(end - begin);
+      for (auto c = begin < size_ ? locate(begin) : chunks_.size(); c < chunks_.size() && offsets_[c] < end; c++) {
+        auto &chunk = *chunks_[c];
+        auto from = begin > offsets_[c] ? begin - offsets_[c] : 0;
+        auto to = std::min(chunk.size(), end - offsets_[c]);
+        result.insert(result.end(), chunk.begin() + from, chunk.begin() + to);
+      }
+      return result;
+    }
+
+    std::vector<T> toVector() const {
+      return slice(0, size_);
+    }
+
+  private:
+
+    // Returns the index of the chunk containing the element at 'index'.
+    size_t locate(size_t index) const {
+      assert(index < size_);
+      auto it = std::upper_bound(offsets_.begin(), offsets_.end(), index);
+      return static_cast<size_t>(it - offsets_.begin()) - 1;
+    }
+
+    void reindex() {
+      offsets_.resize(chunks_.size());
+      size_ = 0;
+      for (size_t c = 0; c < chunks_.size(); c++) {
+        offsets_[c] = size_;
+        size_ += chunks_[c]->size();
+      }
+    }
+  };
+
+  // Computes the edit script between two chunked vectors.
+  // Chunks shared by both sides are skipped by pointer comparison; only the
+  // regions between shared chunks are diffed element by element, so the cost is
+  // proportional to the number of chunks plus the size of the edited regions.
+  template <typename T>
+  std::vector<Diff<T>> diff(const ChunkedVector<T> &x,
+                            const ChunkedVector<T> &y,
+                            const std::function<bool (T, T)> compare = 0) {
+    auto &a = x.chunks();
+    auto &b = y.chunks();
+
+    // skips the shared prefix and suffix.
+    size_t lo = 0;
+    while (lo < a.size() && lo < b.size() && a[lo] == b[lo]) lo++;
+    size_t a_hi = a.size(), b_hi = b.size();
+    while (a_hi > lo && b_hi > lo && a[a_hi-1] == b[b_hi-1]) { a_hi--; b_hi--; }
+
+    // the chunks of 'y' that can be used as anchors in the middle section.
+    std::unordered_map<const std::vector<T>*, size_t> anchors;
+    for (auto j = lo; j < b_hi; j++) anchors.emplace(b[j].get(), j);
+
+    // collects the regions (in chunk indices) that are not shared.
+    struct Region { size_t a_begin, a_end, b_begin, b_end; };
+    std::vector<Region> regions;
+    size_t i = lo, j = lo;
+    while (i < a_hi || j < b_hi) {
+      if (i < a_hi && j < b_hi && a[i] == b[j]) {
+        i++;
+        j++;
+        continue;
+      }
+      // finds the next chunk of 'x' that also appears later on in 'y'.
+      auto next_i = i, next_j = b_hi;
+      for (; next_i < a_hi; next_i++) {
+        auto it = anchors.find(a[next_i].get());
+        if (it != anchors.end() && it->second >= j) {
+          next_j = it->second;
+          break;
+        }
+      }
+      regions.push_back(Region{i, next_i, j, next_j});
+      i = next_i;
+      j = next_j;
+    }
+
+    // diffs the regions back to front, so that the indices of every script
+    // are still valid once the regions that follow have been applied.
+    std::vector<Diff<T>> list;
+    for (auto r = regions.rbegin(); r != regions.rend(); ++r) {
+      auto x_begin = x.chunkOffset(r->a_begin);
+      auto y_begin = y.chunkOffset(r->b_begin);
+      auto region = diff(x.slice(x_begin, x.chunkOffset(r->a_end)),
+                         y.slice(y_begin, y.chunkOffset(r->b_end)),
+                         compare);
+      for (auto &d : region) {
+        d.index += x_begin;
+        list.push_back(d);
+      }
+    }
+    return list;
+  }
+}
+
+#endif /* chunk_h */
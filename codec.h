@@ -0,0 +1,336 @@
+#ifndef codec_h
+#define codec_h
+
+#include "diff.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+namespace buffer {
+
+  // Binary encoding of edit scripts and snapshots.
+  //
+  //   header    'L' 'B' 'U' 'F', format version (u8), kind (u8), count (varint)
+  //   script    runs of operations of the same type, each one introduced by
+  //             varint(length << 2 | opcode); every operation is followed by
+  //             the zigzag varint of its index minus the previous index, then
+  //             by its payloads: the value (INSERT), the previous value
+  //             (DELETE) or both (SUBSTITUTE)
+  //   snapshot  'count' payloads
+  //
+  // Every payload is the varint length of the element encoding followed by
+  // the bytes produced by the element codec, so a reader can walk the data in
+  // place and decode only the elements it needs.
+
+  static const uint8_t kCodecVersion = 1;
+
+  enum EncodingKind { SCRIPT = 1, SNAPSHOT = 2 };
+
+  // Default element codec: the raw bytes of a trivially copyable value.
+  // A codec's 'decode' returns false when the bytes are not a valid encoding,
+  // which makes the whole script or snapshot malformed.
+  template <typename T>
+  struct Codec {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "provide a Codec specialization for non trivially copyable types");
+
+    static void encode(const T &value, std::vector<uint8_t> &out) {
+      auto bytes = reinterpret_cast<const uint8_t*>(&value);
+      out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    static bool decode(const uint8_t *data, size_t size, T &value) {
+      if (size != sizeof(T)) return false;
+      memcpy(&value, data, sizeof(T));
+      return true;
+    }
+  };
+
+  template <>
+  struct Codec<std::string> {
+    static void encode(const std::string &value, std::vector<uint8_t> &out) {
+      out.insert(out.end(), value.begin(), value.end());
+    }
+
+    static bool decode(const uint8_t *data, size_t size, std::string &value) {
+      value.assign(reinterpret_cast<const char*>(data), size);
+      return true;
+    }
+  };
+
+  namespace varint {
+
+    inline void put(uint64_t value, std::vector<uint8_t> &out) {
+      while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+      }
+      out.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Reads a varint at 'cursor', returns false if the data is truncated.
+    inline bool get(const uint8_t *&cursor, const uint8_t *end, uint64_t &value) {
+      value = 0;
+      for (unsigned shift = 0; cursor < end && shift < 64; shift += 7) {
+        auto byte = *cursor++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+      }
+      return false;
+    }
+
+    inline uint64_t zigzag(int64_t value) {
+      return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t value) {
+      return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+  }
+
+  // A range of bytes inside an encoded buffer.
+  struct Bytes {
+    const uint8_t *data;
+    size_t size;
+  };
+
+  namespace detail {
+
+    template <typename T, typename C>
+    void putPayload(const T &value, std::vector<uint8_t> &out, std::vector<uint8_t> &scratch) {
+      scratch.clear();
+      C::encode(value, scratch);
+      varint::put(scratch.size(), out);
+      out.insert(out.end(), scratch.begin(), scratch.end());
+    }
+
+    inline bool getPayload(const uint8_t *&cursor, const uint8_t *end, Bytes &bytes) {
+      uint64_t size;
+      if (!varint::get(cursor, end, size) || size > static_cast<uint64_t>(end - cursor)) return false;
+      bytes = Bytes{cursor, static_cast<size_t>(size)};
+      cursor += size;
+      return true;
+    }
+
+    inline void putHeader(EncodingKind kind, size_t count, std::vector<uint8_t> &out) {
+      const uint8_t magic[] = {'L', 'B', 'U', 'F', kCodecVersion, static_cast<uint8_t>(kind)};
+      out.insert(out.end(), magic, magic + sizeof(magic));
+      varint::put(count, out);
+    }
+
+    // Rejects the counts that the remaining data cannot hold, so that a
+    // malformed header never makes a reader allocate for it.
+    inline bool getHeader(const uint8_t *&cursor, const uint8_t *end, EncodingKind kind, uint64_t &count) {
+      if (end - cursor < 6 || memcmp(cursor, "LBUF", 4) != 0) return false;
+      if (cursor[4] != kCodecVersion || cursor[5] != kind) return false;
+      cursor += 6;
+      uint64_t value;
+      if (!varint::get(cursor, end, value)) return false;
+      // an operation takes at least 2 bytes (index and payload), an element 1.
+      auto min_size = static_cast<uint64_t>(kind == SCRIPT ? 2 : 1);
+      if (value > static_cast<uint64_t>(end - cursor) / min_size) return false;
+      count = value;
+      return true;
+    }
+
+    inline uint64_t opcode(DiffType type) {
+      return type == INSERT ? 0 : type == DELETE ? 1 : 2;
+    }
+  }
+
+  // Appends the encoding of 'diffs' to 'out'.
+  template <typename T, typename C = Codec<T>>
+  void encodeScript(const std::vector<Diff<T>> &diffs, std::vector<uint8_t> &out) {
+    std::vector<uint8_t> scratch;
+    detail::putHeader(SCRIPT, diffs.size(), out);
+    int64_t index = 0;
+    for (size_t k = 0; k < diffs.size();) {
+      auto run = k;
+      while (run < diffs.size() && diffs[run].type == diffs[k].type) run++;
+      varint::put(((run - k) << 2) | detail::opcode(diffs[k].type), out);
+      for (; k < run; k++) {
+        auto &d = diffs[k];
+        varint::put(varint::zigzag(static_cast<int64_t>(d.index) - index), out);
+        index = static_cast<int64_t>(d.index);
+        if (d.type != DELETE) detail::putPayload<T, C>(d.value, out, scratch);
+        if (d.type != INSERT) detail::putPayload<T, C>(d.previous, out, scratch);
+      }
+    }
+  }
+
+  // Appends the encoding of the collection to 'out'.
+  template <typename T, typename C = Codec<T>>
+  void encodeSnapshot(const std::vector<T> &collection, std::vector<uint8_t> &out) {
+    std::vector<uint8_t> scratch;
+    detail::putHeader(SNAPSHOT, collection.size(), out);
+    for (auto &value : collection)
+      detail::putPayload<T, C>(value, out, scratch);
+  }
+
+  // An operation read in place from an encoded script.
+  template <typename T, typename C = Codec<T>>
+  struct EncodedDiff {
+    DiffType type;
+    size_t index;
+    Bytes value;      // Empty for deletions.
+    Bytes previous;   // Empty for insertions.
+
+    // The decoders return false when the element encoding is malformed.
+    bool decodeValue(T &result) const {
+      return C::decode(value.data, value.size, result);
+    }
+
+    bool decodePrevious(T &result) const {
+      return C::decode(previous.data, previous.size, result);
+    }
+
+    bool decode(Diff<T> &diff) const {
+      diff.type = type;
+      diff.index = index;
+      if (type != DELETE && !decodeValue(diff.value)) return false;
+      if (type != INSERT && !decodePrevious(diff.previous)) return false;
+      if (type == INSERT) diff.previous = diff.value;
+      if (type == DELETE) diff.value = diff.previous;
+      return true;
+    }
+  };
+
+  // Iterates over an encoded script without decoding its elements.
+  // The data must outlive the reader.
+  template <typename T, typename C = Codec<T>>
+  class ScriptReader {
+  private:
+    const uint8_t *cursor_;
+    const uint8_t *end_;
+    uint64_t count_ = 0;
+    uint64_t remaining_ = 0;
+    uint64_t run_ = 0;
+    DiffType type_ = INSERT;
+    int64_t index_ = 0;
+    bool is_valid_;
+
+  public:
+
+    ScriptReader(const uint8_t *data, size_t size): cursor_(data), end_(data + size) {
+      is_valid_ = detail::getHeader(cursor_, end_, SCRIPT, count_);
+      remaining_ = is_valid_ ? count_ : 0;
+    }
+
+    // Whether the data is a well formed script (so far).
+    bool isValid() const {
+      return is_valid_;
+    }
+
+    // The number of operations in the script.
+    size_t size() const {
+      return static_cast<size_t>(count_);
+    }
+
+    // Reads the next operation, returns false at the end or on malformed data.
+    bool next(EncodedDiff<T, C> &diff) {
+      if (!is_valid_ || !remaining_) return false;
+      uint64_t value;
+      if (!run_) {
+        if (!varint::get(cursor_, end_, value) || (value & 3) == 3) return invalidate();
+        run_ = value >> 2;
+        type_ = (value & 3) == 0 ? INSERT : (value & 3) == 1 ? DELETE : SUBSTITUTE;
+        if (!run_) return invalidate();
+      }
+      if (!varint::get(cursor_, end_, value)) return invalidate();
+      index_ += varint::unzigzag(value);
+      if (index_ < 0) return invalidate();
+      diff.type = type_;
+      diff.index = static_cast<size_t>(index_);
+      diff.value = diff.previous = Bytes{nullptr, 0};
+      if (type_ != DELETE && !detail::getPayload(cursor_, end_, diff.value)) return invalidate();
+      if (type_ != INSERT && !detail::getPayload(cursor_, end_, diff.previous)) return invalidate();
+      run_--;
+      remaining_--;
+      return true;
+    }
+
+  private:
+
+    bool invalidate() {
+      is_valid_ = false;
+      return false;
+    }
+  };
+
+  // Iterates over an encoded snapshot without decoding its elements.
+  // The data must outlive the reader.
+  template <typename T, typename C = Codec<T>>
+  class SnapshotReader {
+  private:
+    const uint8_t *cursor_;
+    const uint8_t *end_;
+    uint64_t count_ = 0;
+    uint64_t remaining_ = 0;
+    bool is_valid_;
+
+  public:
+
+    SnapshotReader(const uint8_t *data, size_t size): cursor_(data), end_(data + size) {
+      is_valid_ = detail::getHeader(cursor_, end_, SNAPSHOT, count_);
+      remaining_ = is_valid_ ? count_ : 0;
+    }
+
+    bool isValid() const {
+      return is_valid_;
+    }
+
+    // The number of elements in the snapshot.
+    size_t size() const {
+      return static_cast<size_t>(count_);
+    }
+
+    // Reads the next element, returns false at the end or on malformed data.
+    bool next(Bytes &element) {
+      if (!is_valid_ || !remaining_) return false;
+      if (!detail::getPayload(cursor_, end_, element)) {
+        is_valid_ = false;
+        return false;
+      }
+      remaining_--;
+      return true;
+    }
+
+    // Returns false when the element encoding is malformed.
+    bool decode(const Bytes &element, T &value) const {
+      return C::decode(element.data, element.size, value);
+    }
+  };
+
+  // Decodes a whole script, returns false on malformed data.
+  template <typename T, typename C = Codec<T>>
+  bool decodeScript(const uint8_t *data, size_t size, std::vector<Diff<T>> &diffs) {
+    ScriptReader<T, C> reader(data, size);
+    EncodedDiff<T, C> diff;
+    Diff<T> decoded{};
+    diffs.reserve(diffs.size() + reader.size());
+    while (reader.next(diff)) {
+      if (!diff.decode(decoded)) return false;
+      diffs.push_back(decoded);
+    }
+    return reader.isValid();
+  }
+
+  // Decodes a whole snapshot, returns false on malformed data.
+  template <typename T, typename C = Codec<T>>
+  bool decodeSnapshot(const uint8_t *data, size_t size, std::vector<T> &collection) {
+    SnapshotReader<T, C> reader(data, size);
+    Bytes element;
+    T value{};
+    collection.reserve(collection.size() + reader.size());
+    while (reader.next(element)) {
+      if (!reader.decode(element, value)) return false;
+      collection.push_back(value);
+    }
+    return reader.isValid();
+  }
+}
+
+#endif /* codec_h */
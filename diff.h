@@ -1,9 +1,14 @@
 #ifndef diff_hpp
 #define diff_hpp
 
+#include "trace.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <climits>
+#include <memory>
 
 namespace buffer {
 
@@ -14,38 +19,58 @@ namespace buffer {
     DiffType type;    // Whether this is a substitution, a deletion or an insertion.
     size_t index;     // The index that the diff is targetting.
     T value;          // The new value associated to this operation.
+    T previous;       // The value removed by a deletion or a substitution (a copy of 'value' for an insertion).
   };
 
-  // computes the Levenshtein distance between the two vectors passed as argument.
-  template <typename T>
-  std::vector<Diff<T>> diff(const std::vector<T> &x,
-                            const std::vector<T> &y,
-                            const std::function<bool (T, T)> compare = 0) {
+  // Returns the hashes of the elements of 'collection', for 'diffVisitHashed'.
+  template <typename T, typename Hash = std::hash<T>>
+  std::vector<uint64_t> hashes(const std::vector<T> &collection, const Hash &hash = Hash()) {
+    std::vector<uint64_t> result(collection.size());
+    for (size_t i = 0; i < collection.size(); i++) result[i] = hash(collection[i]);
+    return result;
+  }
 
-    // creates the memoization table.
-    const size_t m = x.size();
-    const size_t n = y.size();
-    std::vector<std::vector<int>> table(m+1, std::vector<int>(n+1, 0));
+  // The engine behind the functions below: computes the Levenshtein distance
+  // between two sequences of 'm' and 'n' elements compared by 'is_equal(i, j)'
+  // and walks the edit script, calling 'edit(type, i, j)' for every operation
+  // ('i' being its index and 'j' the position in the target of the new value,
+  // if any) and 'match(i, j)' for every pair of elements it keeps.
+  // The memoization table is a single block obtained from 'allocator'.
+  template <typename Equal, typename Edit, typename Match, typename Allocator = std::allocator<int>>
+  void diffIndices(size_t m,
+                   size_t n,
+                   Equal &&is_equal,
+                   Edit &&edit,
+                   Match &&match,
+                   const Allocator &allocator = Allocator()) {
+    BUFFER_TRACE_SCOPE("diff");
+
+    // creates the memoization table, row 'i' holds the distances from the
+    // first 'i' elements of 'x'.
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<int> TableAllocator;
+    std::vector<int, TableAllocator> cells((m+1) * (n+1), 0, TableAllocator(allocator));
+    auto table = [&cells, n](size_t i) { return cells.data() + i * (n+1); };
 
     // source prefixes can be transformed into empty string by
     // dropping all characters.
-    for (auto i = 1; i < m+1; i++) table[i][0] = i;
+    for (size_t i = 1; i < m+1; i++) table(i)[0] = static_cast<int>(i);
 
     // target prefixes can be reached from empty source prefix
     // by inserting every character.
-    for (auto j = 1; j < n+1; j++) table[0][j] = j;
-
-    // populate the table.
-    for (auto j = 1; j < n+1; j++) {
-      for (auto i = 1; i < m+1; i++) {
-        auto x_val = x[i-1], y_val = y[j-1];
-        if ((compare && (compare(x_val, y_val))) || (!compare && x[i-1] == y[j-1]))
-          table[i][j] = table[i-1][j-1];
+    for (size_t j = 1; j < n+1; j++) table(0)[j] = static_cast<int>(j);
+
+    // populate the table, one row at a time.
+    for (size_t i = 1; i < m+1; i++) {
+      auto row = table(i);
+      auto above = table(i-1);
+      for (size_t j = 1; j < n+1; j++) {
+        if (is_equal(i-1, j-1))
+          row[j] = above[j-1];
         else {
-          auto insertion = table[i][j-1];
-          auto deletion = table[i-1][j];
-          auto substitution = table[i-1][j-1];
-          table[i][j] = std::min(deletion, std::min(insertion, substitution)) + 1;
+          auto insertion = row[j-1];
+          auto deletion = above[j];
+          auto substitution = above[j-1];
+          row[j] = std::min(deletion, std::min(insertion, substitution)) + 1;
         }
       }
     }
@@ -53,33 +78,93 @@ namespace buffer {
     // backtrack the changes.
     int i = (int)m;
     int j = (int)n;
-    std::vector<Diff<T>> list;
     while (i > 0 || j > 0) {
 
       // sanity check.
       if (i < 0 || j < 0) break;
 
       // computes the likelihood of the ops.
-      auto insertion = j > 0 ? table[i][j-1] : INT_MAX;
-      auto deletion  = i > 0 ? table[i-1][j] : INT_MAX;
-      auto diagonal  = (i > 0 && j > 0) ? table[i-1][j-1] : INT_MAX;
+      auto current = table(i)[j];
+      auto insertion = j > 0 ? table(i)[j-1] : INT_MAX;
+      auto diagonal  = (i > 0 && j > 0) ? table(i-1)[j-1] : INT_MAX;
+
+      // a diagonal step is a match only if the elements are actually equal:
+      // when insertion and deletion tie the table alone is ambiguous.
+      auto is_match = diagonal == current && is_equal(i-1, j-1);
 
       // creates the operations.
-      if (insertion < diagonal && insertion < deletion) {
-        list.push_back(Diff<T>{INSERT, static_cast<size_t>(i), y[j-1]});
-        --j;
-      } else if (deletion < diagonal && deletion < insertion) {
-        list.push_back(Diff<T>{DELETE, static_cast<size_t>(i-1), x[i-1]});
+      if (is_match) {
+        match(static_cast<size_t>(i-1), static_cast<size_t>(j-1));
         --i;
-      } else if (diagonal == table[i][j]) {
+        --j;
+      } else if (diagonal != INT_MAX && diagonal + 1 == current) {
+        edit(SUBSTITUTE, static_cast<size_t>(i-1), static_cast<size_t>(j-1));
         --i;
         --j;
+      } else if (insertion != INT_MAX && insertion + 1 == current) {
+        edit(INSERT, static_cast<size_t>(i), static_cast<size_t>(j-1));
+        --j;
       } else {
-        list.push_back(Diff<T>{SUBSTITUTE, static_cast<size_t>(i-1), y[j-1]});
+        edit(DELETE, static_cast<size_t>(i-1), static_cast<size_t>(j));
         --i;
-        --j;
       }
     }
+  }
+
+  // Same as 'diffVisit', comparing the precomputed hashes of the elements
+  // first: the elements themselves are only compared when their hashes match,
+  // which turns most of the comparisons into integer ones for expensive types.
+  // The hashes must agree with 'compare' (or '=='). They are only used when
+  // both sides have them: pass null for both to compare the elements only.
+  template <typename T, typename Visitor, typename Allocator = std::allocator<int>>
+  void diffVisitHashed(const std::vector<T> &x,
+                       const std::vector<T> &y,
+                       const uint64_t *x_hashes,
+                       const uint64_t *y_hashes,
+                       const std::function<bool (T, T)> &compare,
+                       Visitor &&visitor,
+                       const Allocator &allocator = Allocator()) {
+    auto is_hashed = x_hashes && y_hashes;
+    auto is_equal = [&](size_t i, size_t j) {
+      if (is_hashed && x_hashes[i] != y_hashes[j]) return false;
+      return compare ? compare(x[i], y[j]) : x[i] == y[j];
+    };
+    diffIndices(x.size(), y.size(), is_equal, [&](DiffType type, size_t i, size_t j) {
+      if (type == DELETE) visitor(type, i, x[i], x[i]);
+      else visitor(type, i, y[j], type == INSERT ? y[j] : x[i]);
+    }, [](size_t, size_t) {}, allocator);
+  }
+
+  // computes the Levenshtein distance between the two vectors passed as argument
+  // and walks the edit script that transforms 'x' into 'y', calling
+  // 'visitor(type, index, value, previous)' for every operation as soon as the
+  // traceback finds it, without materializing the script.
+  // The operations come in the order described for 'diff' ('previous' is a
+  // copy of 'value' for insertions). The memoization table is a single block
+  // obtained from 'allocator' (e.g. an arena, see arena.h).
+  template <typename T, typename Visitor, typename Allocator = std::allocator<int>>
+  void diffVisit(const std::vector<T> &x,
+                 const std::vector<T> &y,
+                 const std::function<bool (T, T)> &compare,
+                 Visitor &&visitor,
+                 const Allocator &allocator = Allocator()) {
+    diffVisitHashed(x, y, nullptr, nullptr, compare, std::forward<Visitor>(visitor), allocator);
+  }
+
+  // computes the Levenshtein distance between the two vectors passed as argument.
+  // The returned edit script transforms 'x' into 'y' when applied in order: the
+  // indices are non-increasing, so every operation only touches positions that
+  // the previous ones left untouched.
+  // Both the script and the memoization table are obtained from 'allocator'.
+  template <typename T, typename Allocator = std::allocator<Diff<T>>>
+  std::vector<Diff<T>, Allocator> diff(const std::vector<T> &x,
+                                       const std::vector<T> &y,
+                                       const std::function<bool (T, T)> compare = 0,
+                                       const Allocator &allocator = Allocator()) {
+    std::vector<Diff<T>, Allocator> list(allocator);
+    diffVisit(x, y, compare, [&list](DiffType type, size_t index, const T &value, const T &previous) {
+      list.push_back(Diff<T>{type, index, value, type == INSERT ? value : previous});
+    }, allocator);
     return list;
   }
 }
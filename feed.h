@@ -0,0 +1,505 @@
+#ifndef feed_h
+#define feed_h
+
+#ifdef __linux__
+
+#include "buffer.h"
+#include "codec.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+namespace buffer {
+
+  // A change feed that streams the updates of a buffer to the processes of the
+  // same host over a Unix domain socket.
+  //
+  // Every update is encoded once (see codec.h) and the resulting frame is
+  // shared by all the clients, so subscribing more clients costs neither diffs
+  // nor encodings:
+  //
+  //   frame     kind (u32), payload length (u32), version (u64), payload
+  //
+  // A client opens the stream by sending the version of the collection it
+  // already has (u64, 0 for none). The server replays the frames that follow
+  // that version when they are still in its history, and starts with a
+  // snapshot otherwise. The sockets are served by a single epoll thread, which
+  // writes the frames queued for a client in batches; a client that falls too
+  // far behind is disconnected and can resume from its last version.
+  namespace feed {
+
+    static const size_t kFrameHeaderSize = 16;
+
+    typedef std::shared_ptr<const std::vector<uint8_t>> Frame;
+
+    template <typename V>
+    inline void put(std::vector<uint8_t> &out, size_t offset, V value) {
+      memcpy(out.data() + offset, &value, sizeof(V));
+    }
+
+    template <typename V>
+    inline V get(const uint8_t *data) {
+      V value;
+      memcpy(&value, data, sizeof(V));
+      return value;
+    }
+
+    // Encodes a frame with 'encode' appending the payload.
+    template <typename F>
+    Frame frame(EncodingKind kind, uint64_t version, F encode) {
+      auto data = std::make_shared<std::vector<uint8_t>>(kFrameHeaderSize);
+      encode(*data);
+      put<uint32_t>(*data, 0, kind);
+      put<uint32_t>(*data, 4, static_cast<uint32_t>(data->size() - kFrameHeaderSize));
+      put<uint64_t>(*data, 8, version);
+      return data;
+    }
+
+    inline bool address(const std::string &path, sockaddr_un &result) {
+      if (path.size() >= sizeof(result.sun_path)) return false;
+      memset(&result, 0, sizeof(result));
+      result.sun_family = AF_UNIX;
+      memcpy(result.sun_path, path.c_str(), path.size());
+      return true;
+    }
+  }
+
+  // Serves the updates of a buffer on a Unix domain socket.
+  // Attach it to the buffer with 'addUpdateListener'.
+  template <typename T, typename C = Codec<T>>
+  class FeedServer: public UpdateListener<T> {
+  private:
+
+    struct Client {
+      int fd;
+      bool is_subscribed = false;
+      bool is_waiting = false;          // Whether it waits for EPOLLOUT.
+      uint8_t handshake[8];
+      size_t handshake_size = 0;
+      std::deque<feed::Frame> frames;   // The frames to write.
+      size_t offset = 0;                // The bytes of the first frame already written.
+      size_t backlog = 0;               // The bytes left to write.
+    };
+
+    std::string path_;
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int event_fd_ = -1;
+    std::thread worker_;
+    std::atomic<size_t> client_count_{0};
+
+    // shared with the buffer.
+    std::mutex lock_;
+    std::vector<Update<T>> updates_;
+    bool is_closed_ = false;
+
+    // owned by the worker.
+    std::unordered_map<int, Client> clients_;
+    std::deque<std::pair<uint64_t, feed::Frame>> history_;
+    uint64_t history_base_ = 0;         // The version the history starts from.
+    Update<T> latest_{};
+    feed::Frame snapshot_;              // The snapshot of 'latest_', once encoded.
+    size_t history_capacity_;
+    size_t backlog_capacity_;
+
+  public:
+
+    // Listens on 'path'; check 'isOpen' for failures. The last 'history'
+    // frames are kept for the clients that resume, and a client is
+    // disconnected when more than 'backlog' bytes are waiting for it.
+    FeedServer(const std::string &path, size_t history = 1024, size_t backlog = 1 << 24):
+        path_(path), history_capacity_(history), backlog_capacity_(backlog) {
+      sockaddr_un address;
+      if (!feed::address(path_, address)) return;
+      unlink(path_.c_str());
+      listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+      event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (listen_fd_ < 0 || epoll_fd_ < 0 || event_fd_ < 0 ||
+          bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+          listen(listen_fd_, SOMAXCONN) != 0 ||
+          !watch(listen_fd_, EPOLL_CTL_ADD, EPOLLIN) || !watch(event_fd_, EPOLL_CTL_ADD, EPOLLIN)) {
+        release();
+        return;
+      }
+      worker_ = std::thread(&FeedServer::run, this);
+    }
+
+    ~FeedServer() {
+      if (worker_.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          is_closed_ = true;
+        }
+        wake();
+        worker_.join();
+      }
+      release();
+    }
+
+    bool isOpen() const {
+      return worker_.joinable();
+    }
+
+    // The number of connected clients.
+    size_t clients() const {
+      return client_count_.load();
+    }
+
+    // Hands the update over to the worker, which encodes and sends it.
+    virtual void onBufferUpdate(const Update<T> &update) {
+      if (!isOpen()) return;
+      std::lock_guard<std::mutex> lock(lock_);
+      updates_.push_back(update);
+      if (updates_.size() == 1) wake();
+    }
+
+  private:
+
+    void wake() {
+      uint64_t value = 1;
+      auto result = ::write(event_fd_, &value, sizeof(value));
+      (void)result;
+    }
+
+    bool watch(int fd, int operation, uint32_t events) {
+      epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = events;
+      event.data.fd = fd;
+      return epoll_ctl(epoll_fd_, operation, fd, &event) == 0;
+    }
+
+    void release() {
+      for (auto &client : clients_) ::close(client.first);
+      clients_.clear();
+      client_count_ = 0;
+      if (listen_fd_ >= 0) {
+        ::close(listen_fd_);
+        unlink(path_.c_str());
+      }
+      if (epoll_fd_ >= 0) ::close(epoll_fd_);
+      if (event_fd_ >= 0) ::close(event_fd_);
+      listen_fd_ = epoll_fd_ = event_fd_ = -1;
+    }
+
+    // The body of the worker thread.
+    void run() {
+      epoll_event events[64];
+      while (true) {
+        auto count = epoll_wait(epoll_fd_, events, 64, -1);
+        if (count < 0 && errno != EINTR) return;
+        for (auto k = 0; k < count; k++) {
+          auto fd = events[k].data.fd;
+          if (fd == event_fd_) {
+            if (!dispatch()) return;
+          } else if (fd == listen_fd_) {
+            accept();
+          } else {
+            auto client = clients_.find(fd);
+            if (client == clients_.end()) continue;
+            auto is_alive = !(events[k].events & (EPOLLERR | EPOLLHUP));
+            if (is_alive && (events[k].events & EPOLLIN)) is_alive = receive(client->second);
+            if (is_alive && (events[k].events & EPOLLOUT)) is_alive = flush(client->second);
+            if (!is_alive) disconnect(fd);
+          }
+        }
+      }
+    }
+
+    // Encodes the pending updates and queues them for the clients. Returns
+    // false once the server is closed.
+    bool dispatch() {
+      uint64_t value;
+      auto result = ::read(event_fd_, &value, sizeof(value));
+      (void)result;
+      std::vector<Update<T>> updates;
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (is_closed_) return false;
+        updates.swap(updates_);
+      }
+      for (auto &update : updates) {
+        latest_ = update;
+        snapshot_ = nullptr;
+        if (!update.diffs) {
+          // a reset invalidates the history.
+          history_.clear();
+          history_base_ = update.version;
+          for (auto &client : clients_)
+            if (client.second.is_subscribed) enqueue(client.second, snapshot());
+          continue;
+        }
+        auto frame = feed::frame(SCRIPT, update.version, [&update](std::vector<uint8_t> &out) {
+          encodeScript<T, C>(*update.diffs, out);
+        });
+        history_.push_back(std::make_pair(update.version, frame));
+        while (history_.size() > history_capacity_) {
+          history_base_ = history_.front().first;
+          history_.pop_front();
+        }
+        for (auto &client : clients_)
+          if (client.second.is_subscribed) enqueue(client.second, frame);
+      }
+      // every client gets all the frames of this pass in a single write.
+      std::vector<int> disconnected;
+      for (auto &client : clients_)
+        if (!flush(client.second)) disconnected.push_back(client.first);
+      for (auto fd : disconnected) disconnect(fd);
+      return true;
+    }
+
+    // The snapshot of the latest collection, encoded on demand.
+    feed::Frame snapshot() {
+      if (!snapshot_) {
+        auto &collection = *latest_.collection;
+        snapshot_ = feed::frame(SNAPSHOT, latest_.version, [&collection](std::vector<uint8_t> &out) {
+          encodeSnapshot<T, C>(collection, out);
+        });
+      }
+      return snapshot_;
+    }
+
+    void accept() {
+      while (true) {
+        auto fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (!watch(fd, EPOLL_CTL_ADD, EPOLLIN)) {
+          ::close(fd);
+          continue;
+        }
+        auto &client = clients_[fd];
+        client.fd = fd;
+        client_count_ = clients_.size();
+      }
+    }
+
+    void disconnect(int fd) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+      ::close(fd);
+      clients_.erase(fd);
+      client_count_ = clients_.size();
+    }
+
+    // Reads the handshake of the client. Returns false if it hung up.
+    bool receive(Client &client) {
+      uint8_t data[64];
+      while (true) {
+        auto wanted = client.is_subscribed ? sizeof(data) : sizeof(client.handshake) - client.handshake_size;
+        auto target = client.is_subscribed ? data : client.handshake + client.handshake_size;
+        auto result = ::read(client.fd, target, wanted);
+        if (result == 0) return false;
+        if (result < 0) return errno == EAGAIN || errno == EINTR;
+        if (client.is_subscribed) continue;
+        client.handshake_size += static_cast<size_t>(result);
+        if (client.handshake_size == sizeof(client.handshake)) {
+          subscribe(client, feed::get<uint64_t>(client.handshake));
+          if (!flush(client)) return false;
+        }
+      }
+    }
+
+    // Starts the stream of a client that has the collection at 'version'.
+    void subscribe(Client &client, uint64_t version) {
+      client.is_subscribed = true;
+      // the client gets the snapshot with the first reset.
+      if (!latest_.collection) return;
+      if (version && version >= history_base_ && version <= latest_.version) {
+        for (auto &frame : history_)
+          if (frame.first > version) enqueue(client, frame.second);
+        return;
+      }
+      enqueue(client, snapshot());
+    }
+
+    void enqueue(Client &client, const feed::Frame &frame) {
+      client.frames.push_back(frame);
+      client.backlog += frame->size();
+    }
+
+    // Writes the queued frames until the socket is full. Returns false if the
+    // client hung up or fell too far behind.
+    bool flush(Client &client) {
+      while (!client.frames.empty()) {
+        iovec vectors[64];
+        int count = 0;
+        for (auto frame = client.frames.begin(); frame != client.frames.end() && count < 64; ++frame, ++count) {
+          auto offset = count ? 0 : client.offset;
+          vectors[count].iov_base = const_cast<uint8_t*>((*frame)->data() + offset);
+          vectors[count].iov_len = (*frame)->size() - offset;
+        }
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = vectors;
+        message.msg_iovlen = static_cast<size_t>(count);
+        auto result = sendmsg(client.fd, &message, MSG_NOSIGNAL);
+        if (result < 0) {
+          if (errno == EINTR) continue;
+          if (errno != EAGAIN) return false;
+          if (client.backlog > backlog_capacity_) return false;
+          if (!client.is_waiting) client.is_waiting = watch(client.fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+          return true;
+        }
+        auto written = static_cast<size_t>(result);
+        client.backlog -= written;
+        while (written) {
+          auto left = client.frames.front()->size() - client.offset;
+          if (written < left) {
+            client.offset += written;
+            break;
+          }
+          written -= left;
+          client.offset = 0;
+          client.frames.pop_front();
+        }
+      }
+      if (client.is_waiting) client.is_waiting = !watch(client.fd, EPOLL_CTL_MOD, EPOLLIN);
+      return true;
+    }
+  };
+
+  // Subscribes to a 'FeedServer', maintaining a local copy of the collection.
+  template <typename T, typename C = Codec<T>>
+  class FeedClient {
+  private:
+    int fd_ = -1;
+    uint64_t version_;
+    std::vector<T> collection_;
+    std::vector<Diff<T>> diffs_;
+    std::vector<uint8_t> payload_;
+
+  public:
+
+    // Connects to the server at 'path'. A client that already has the
+    // collection at 'version' (e.g. from a previous connection) passes it in
+    // to receive only the frames that followed.
+    FeedClient(const std::string &path, std::vector<T> collection = std::vector<T>(), uint64_t version = 0):
+        version_(version), collection_(std::move(collection)) {
+      sockaddr_un address;
+      if (!feed::address(path, address)) return;
+      fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd_ < 0) return;
+      if (connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+          !write(&version, sizeof(version))) {
+        close();
+      }
+    }
+
+    ~FeedClient() {
+      close();
+    }
+
+    FeedClient(const FeedClient&) = delete;
+    FeedClient &operator=(const FeedClient&) = delete;
+
+    bool isOpen() const {
+      return fd_ >= 0;
+    }
+
+    // The socket, to wait for data with poll/epoll.
+    int getDescriptor() const {
+      return fd_;
+    }
+
+    // The local copy of the collection and its version.
+    const std::vector<T> &getCollection() const {
+      return collection_;
+    }
+
+    uint64_t getVersion() const {
+      return version_;
+    }
+
+    // Blocks until the next frame, applies it and notifies 'subscriber' (if
+    // any). Returns false when the connection is closed or the data malformed.
+    bool receive(Subscriber<T> *subscriber = nullptr) {
+      uint8_t header[feed::kFrameHeaderSize];
+      if (!read(header, sizeof(header))) return false;
+      auto kind = feed::get<uint32_t>(header);
+      auto version = feed::get<uint64_t>(header + 8);
+      payload_.resize(feed::get<uint32_t>(header + 4));
+      if (!read(payload_.data(), payload_.size())) return false;
+      if (kind == SNAPSHOT) {
+        std::vector<T> collection;
+        if (!decodeSnapshot<T, C>(payload_.data(), payload_.size(), collection)) return fail();
+        collection_.swap(collection);
+        version_ = version;
+        if (subscriber) {
+          subscriber->onBufferWillChange();
+          subscriber->onBufferReset(collection_);
+          subscriber->onBufferDidChange();
+        }
+        return true;
+      }
+      diffs_.clear();
+      if (kind != SCRIPT || !decodeScript<T, C>(payload_.data(), payload_.size(), diffs_)) return fail();
+      // a script that does not fit the local copy is as malformed as any.
+      if (!isApplicable(diffs_, collection_.size())) return fail();
+      apply(collection_, diffs_);
+      version_ = version;
+      if (subscriber && !diffs_.empty()) {
+        subscriber->onBufferWillChange();
+        for (auto &diff : diffs_)
+          subscriber->onBufferChange(diff.type, diff.index, diff.value);
+        subscriber->onBufferDidChange();
+      }
+      return true;
+    }
+
+  private:
+
+    bool read(void *data, size_t size) {
+      auto cursor = static_cast<uint8_t*>(data);
+      while (size && fd_ >= 0) {
+        auto result = ::read(fd_, cursor, size);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return fail();
+        cursor += result;
+        size -= static_cast<size_t>(result);
+      }
+      return fd_ >= 0;
+    }
+
+    bool write(const void *data, size_t size) {
+      auto cursor = static_cast<const uint8_t*>(data);
+      while (size) {
+        auto result = send(fd_, cursor, size, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return false;
+        cursor += result;
+        size -= static_cast<size_t>(result);
+      }
+      return true;
+    }
+
+    bool fail() {
+      close();
+      return false;
+    }
+
+    void close() {
+      if (fd_ >= 0) ::close(fd_);
+      fd_ = -1;
+    }
+  };
+}
+
+#endif /* __linux__ */
+
+#endif /* feed_h */
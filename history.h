@@ -0,0 +1,174 @@
+#ifndef history_h
+#define history_h
+
+#include "buffer.h"
+#include "chunk.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
+
+namespace buffer {
+
+  // Retains the recent versions of a buffer for time-travel reads.
+  //
+  // Every version is kept as a chunked vector (see chunk.h) built by applying
+  // the script of the update to the previous version, so consecutive versions
+  // share all the chunks the update did not touch, together with the script
+  // itself. The oldest versions are dropped once the retained data exceeds the
+  // memory budget. Attach it to the buffer with 'addUpdateListener'.
+  template <typename T>
+  class History: public UpdateListener<T> {
+  public:
+    typedef std::chrono::system_clock Clock;
+
+  private:
+    struct Entry {
+      uint64_t version;
+      Clock::time_point time;
+      std::shared_ptr<const std::vector<Diff<T>>> diffs;  // From the previous version, or null.
+      ChunkedVector<T> collection;
+      size_t bytes;                                       // The memory not shared with the previous version.
+    };
+
+    std::deque<Entry> entries_;
+    size_t budget_;
+    size_t chunk_size_;
+    size_t bytes_ = 0;
+    mutable std::mutex lock_;
+
+  public:
+
+    // Retains up to (about) 'budget' bytes of history.
+    explicit History(size_t budget = 1 << 26, size_t chunk_size = 64):
+        budget_(budget), chunk_size_(chunk_size) {}
+
+    // The oldest and the latest retained versions (0 when empty).
+    uint64_t getOldestVersion() const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return entries_.empty() ? 0 : entries_.front().version;
+    }
+
+    uint64_t getLatestVersion() const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return entries_.empty() ? 0 : entries_.back().version;
+    }
+
+    // The number of retained versions and their estimated footprint.
+    size_t size() const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return entries_.size();
+    }
+
+    size_t bytes() const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return bytes_;
+    }
+
+    // The latest version recorded at or before 'time', or 0 if that version
+    // is no longer retained.
+    uint64_t getVersion(Clock::time_point time) const {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto it = std::upper_bound(entries_.begin(), entries_.end(), time,
+                                 [](Clock::time_point t, const Entry &e) { return t < e.time; });
+      return it == entries_.begin() ? 0 : (it - 1)->version;
+    }
+
+    // Retrieves the collection at 'version'. The result shares its chunks with
+    // the history, so the call is cheap. Returns false if it is not retained.
+    bool getCollection(uint64_t version, ChunkedVector<T> &collection) const {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto entry = find(version);
+      if (entry == entries_.end()) return false;
+      collection = entry->collection;
+      return true;
+    }
+
+    // Computes the script that turns the collection at 'from' into the one at
+    // 'to' (either can be the older one) by composing the retained scripts.
+    // Returns false if either version is not retained.
+    bool diffBetween(uint64_t from, uint64_t to, std::vector<Diff<T>> &diffs) const {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto a = find(std::min(from, to));
+      auto b = find(std::max(from, to));
+      if (a == entries_.end() || b == entries_.end()) return false;
+      std::vector<Diff<T>> result;
+      for (auto entry = a + 1; entry <= b; ++entry) {
+        if (!entry->diffs) {
+          // a reset has no script: falls back to the chunk-level diff.
+          result = diff(a->collection, b->collection);
+          break;
+        }
+        result = entry == a + 1 ? *entry->diffs : compose(result, *entry->diffs);
+      }
+      diffs = from <= to ? std::move(result) : invert(result);
+      return true;
+    }
+
+    // Drops the whole history.
+    void clear() {
+      std::lock_guard<std::mutex> lock(lock_);
+      entries_.clear();
+      bytes_ = 0;
+    }
+
+    virtual void onBufferUpdate(const Update<T> &update) {
+      std::lock_guard<std::mutex> lock(lock_);
+      // the versions of a restored buffer may go backwards.
+      if (!entries_.empty() && update.version <= entries_.back().version) {
+        entries_.clear();
+        bytes_ = 0;
+      }
+      auto entry = Entry{update.version, Clock::now(), update.diffs, ChunkedVector<T>(chunk_size_), 0};
+      if (update.diffs && !entries_.empty()) {
+        entry.collection = entries_.back().collection;
+        entry.collection.apply(*update.diffs);
+        entry.bytes = footprint(entry, &entries_.back());
+      } else {
+        entry.diffs = nullptr;
+        entry.collection = ChunkedVector<T>(*update.collection, chunk_size_);
+        entry.bytes = footprint(entry, nullptr);
+      }
+      bytes_ += entry.bytes;
+      entries_.push_back(std::move(entry));
+
+      // the new oldest version owns the chunks it shared with the dropped one.
+      while (bytes_ > budget_ && entries_.size() > 1) {
+        bytes_ -= entries_.front().bytes;
+        entries_.pop_front();
+        auto &front = entries_.front();
+        bytes_ -= front.bytes;
+        front.bytes = footprint(front, nullptr);
+        bytes_ += front.bytes;
+      }
+    }
+
+  private:
+
+    typename std::deque<Entry>::const_iterator find(uint64_t version) const {
+      auto it = std::lower_bound(entries_.begin(), entries_.end(), version,
+                                 [](const Entry &e, uint64_t v) { return e.version < v; });
+      return it != entries_.end() && it->version == version ? it : entries_.end();
+    }
+
+    // The memory held by 'entry' and not by 'previous'.
+    static size_t footprint(const Entry &entry, const Entry *previous) {
+      auto &chunks = entry.collection.chunks();
+      auto bytes = sizeof(Entry) + chunks.size() * (sizeof(chunks[0]) + sizeof(size_t));
+      if (entry.diffs) bytes += entry.diffs->size() * sizeof(Diff<T>);
+      std::unordered_set<const std::vector<T>*> shared;
+      if (previous)
+        for (auto &chunk : previous->collection.chunks()) shared.insert(chunk.get());
+      for (auto &chunk : chunks)
+        if (!shared.count(chunk.get())) bytes += chunk->size() * sizeof(T);
+      return bytes;
+    }
+  };
+}
+
+#endif /* history_h */
@@ -0,0 +1,213 @@
+#ifndef index_h
+#define index_h
+
+#include "buffer.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+
+namespace buffer {
+
+  // Maps a key extracted from every element to the element's current position,
+  // maintained incrementally from the updates of a buffer.
+  //
+  // The elements are the nodes of an implicit treap (a randomized balanced tree
+  // ordered by position, where every node stores the size of its subtree) and a
+  // hash map goes from each key to its node. An edit inserts or removes a single
+  // node, shifting the position of all the nodes that follow at once, and the
+  // position of a node is the number of nodes on its left, counted walking up
+  // to the root: updates cost O(log n) per edit, lookups O(log n).
+  // Attach it to the buffer with 'addUpdateListener'.
+  template <typename T, typename K>
+  class KeyIndex: public UpdateListener<T> {
+  public:
+    typedef std::function<K (const T &)> KeyFunction;
+
+  private:
+    struct Node {
+      K key;
+      uint32_t priority;
+      size_t size;
+      Node *left;
+      Node *right;
+      Node *parent;
+    };
+
+    KeyFunction key_fnc_;
+    Node *root_ = nullptr;
+    // keys are expected to be unique: for duplicates the lookups return one of
+    // the occurrences.
+    std::unordered_multimap<K, Node*> nodes_;
+    uint32_t seed_ = 2463534242u;
+    mutable std::mutex lock_;
+
+  public:
+
+    explicit KeyIndex(KeyFunction key_fnc): key_fnc_(key_fnc) {}
+
+    ~KeyIndex() {
+      destroy(root_);
+    }
+
+    KeyIndex(const KeyIndex&) = delete;
+    KeyIndex &operator=(const KeyIndex&) = delete;
+
+    // Retrieves the current position of the element with the given key.
+    // Returns false if there is no such element.
+    bool find(const K &key, size_t &index) const {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto it = nodes_.find(key);
+      if (it == nodes_.end()) return false;
+      index = position(it->second);
+      return true;
+    }
+
+    bool contains(const K &key) const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return nodes_.count(key) > 0;
+    }
+
+    // The number of indexed elements.
+    size_t size() const {
+      std::lock_guard<std::mutex> lock(lock_);
+      return sizeOf(root_);
+    }
+
+    virtual void onBufferUpdate(const Update<T> &update) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (!update.diffs) return reset(*update.collection);
+      // the script is canonical: every edit targets a position that the edits
+      // applied before it did not shift.
+      for (auto &diff : *update.diffs) {
+        switch (diff.type) {
+          case INSERT: {
+            auto node = create(key_fnc_(diff.value));
+            Node *left, *right;
+            split(root_, diff.index, left, right);
+            root_ = merge(merge(left, node), right);
+            break;
+          }
+          case DELETE: {
+            Node *left, *middle, *right;
+            split(root_, diff.index, left, right);
+            split(right, 1, middle, right);
+            root_ = merge(left, right);
+            unlink(middle);
+            delete middle;
+            break;
+          }
+          default: {
+            auto node = nodeAt(diff.index);
+            auto key = key_fnc_(diff.value);
+            if (node->key == key) break;
+            unlink(node);
+            node->key = key;
+            nodes_.insert(std::make_pair(node->key, node));
+            break;
+          }
+        }
+      }
+    }
+
+  private:
+
+    void reset(const std::vector<T> &collection) {
+      destroy(root_);
+      root_ = nullptr;
+      nodes_.clear();
+      nodes_.reserve(collection.size());
+      for (auto &value : collection)
+        root_ = merge(root_, create(key_fnc_(value)));
+    }
+
+    Node *create(const K &key) {
+      // xorshift32.
+      seed_ ^= seed_ << 13;
+      seed_ ^= seed_ >> 17;
+      seed_ ^= seed_ << 5;
+      auto node = new Node{key, seed_, 1, nullptr, nullptr, nullptr};
+      nodes_.insert(std::make_pair(node->key, node));
+      return node;
+    }
+
+    // Removes the node from the key map.
+    void unlink(Node *node) {
+      auto range = nodes_.equal_range(node->key);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second != node) continue;
+        nodes_.erase(it);
+        return;
+      }
+    }
+
+    static void destroy(Node *node) {
+      if (!node) return;
+      destroy(node->left);
+      destroy(node->right);
+      delete node;
+    }
+
+    static size_t sizeOf(const Node *node) {
+      return node ? node->size : 0;
+    }
+
+    static Node *refresh(Node *node) {
+      node->size = 1 + sizeOf(node->left) + sizeOf(node->right);
+      if (node->left) node->left->parent = node;
+      if (node->right) node->right->parent = node;
+      node->parent = nullptr;
+      return node;
+    }
+
+    // Splits the tree into its first 'count' nodes and the others.
+    static void split(Node *node, size_t count, Node *&left, Node *&right) {
+      if (!node) {
+        left = right = nullptr;
+        return;
+      }
+      if (sizeOf(node->left) < count) {
+        split(node->right, count - sizeOf(node->left) - 1, node->right, right);
+        left = refresh(node);
+      } else {
+        split(node->left, count, left, node->left);
+        right = refresh(node);
+      }
+    }
+
+    static Node *merge(Node *left, Node *right) {
+      if (!left || !right) return left ? left : right;
+      if (left->priority > right->priority) {
+        left->right = merge(left->right, right);
+        return refresh(left);
+      }
+      right->left = merge(left, right->left);
+      return refresh(right);
+    }
+
+    Node *nodeAt(size_t index) const {
+      auto node = root_;
+      while (true) {
+        auto left = sizeOf(node->left);
+        if (index == left) return node;
+        if (index < left) {
+          node = node->left;
+        } else {
+          index -= left + 1;
+          node = node->right;
+        }
+      }
+    }
+
+    static size_t position(const Node *node) {
+      auto index = sizeOf(node->left);
+      for (; node->parent; node = node->parent)
+        if (node->parent->right == node) index += sizeOf(node->parent->left) + 1;
+      return index;
+    }
+  };
+}
+
+#endif /* index_h */
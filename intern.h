@@ -0,0 +1,70 @@
+#ifndef intern_h
+#define intern_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+namespace buffer {
+
+  // Interface of an interner: maps elements to dense integer ids, so that the
+  // diffs can be computed on integer arrays whatever the type of the elements.
+  template <typename T>
+  class Interning {
+  public:
+    virtual ~Interning() {}
+
+    // Replaces 'ids' with the ids of the elements of 'collection'. Equal
+    // elements get the same id for as long as the interner is not cleared.
+    virtual void intern(const std::vector<T> &collection, std::vector<uint32_t> &ids) = 0;
+
+    // The number of distinct elements interned so far.
+    virtual size_t size() const = 0;
+
+    // Forgets all the ids.
+    virtual void clear() = 0;
+
+    // Changes with every 'clear', so that the users of a shared interner can
+    // tell that the ids they kept are void.
+    virtual uint64_t generation() const = 0;
+  };
+
+  // Interner backed by a hash table; 'Hash' and 'Equal' define which elements
+  // share an id.
+  template <typename T, typename Hash = std::hash<T>, typename Equal = std::equal_to<T>>
+  class Interner: public Interning<T> {
+  private:
+    std::unordered_map<T, uint32_t, Hash, Equal> ids_;
+    uint64_t generation_ = 0;
+
+  public:
+
+    explicit Interner(const Hash &hash = Hash(), const Equal &equal = Equal()): ids_(0, hash, equal) {}
+
+    virtual void intern(const std::vector<T> &collection, std::vector<uint32_t> &ids) {
+      ids.resize(collection.size());
+      for (size_t i = 0; i < collection.size(); i++) {
+        // looked up first: 'emplace' allocates a node even for known elements.
+        auto it = ids_.find(collection[i]);
+        ids[i] = it != ids_.end() ? it->second : ids_.emplace(collection[i], static_cast<uint32_t>(ids_.size())).first->second;
+      }
+    }
+
+    virtual size_t size() const {
+      return ids_.size();
+    }
+
+    virtual void clear() {
+      ids_.clear();
+      generation_++;
+    }
+
+    virtual uint64_t generation() const {
+      return generation_;
+    }
+  };
+}
+
+#endif /* intern_h */
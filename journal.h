@@ -0,0 +1,234 @@
+#ifndef journal_h
+#define journal_h
+
+#include "buffer.h"
+#include "codec.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace buffer {
+
+  // An append-only, memory-mapped log of the updates of a buffer.
+  //
+  // Every committed script is appended as a record, and a snapshot of the
+  // collection (a checkpoint) is appended every 'checkpoint_interval' updates.
+  // The file header points at the last checkpoint, so restoring a buffer only
+  // replays the scripts appended after it.
+  //
+  //   header    'L' 'B' 'J' 'R', format version (u32), tail offset (u64),
+  //             last checkpoint offset (u64), last version (u64)
+  //   record    kind (u32), payload length (u32), version (u64), payload
+  //             (see codec.h) padded to 8 bytes
+  //
+  // A record becomes visible only once the tail offset is moved past it, so a
+  // process crash while appending leaves the journal in its previous state.
+  // Surviving a power loss or a kernel crash takes a durable journal, which
+  // flushes every record to disk before publishing it (and the header right
+  // after), at the cost of two synchronous writes per update; otherwise the
+  // header may reach the disk before the record it points to.
+  template <typename T, typename C = Codec<T>>
+  class Journal: public UpdateListener<T> {
+  private:
+
+    static const uint32_t kFormatVersion = 1;
+    static const size_t kHeaderSize = 32;
+    static const size_t kRecordHeaderSize = 16;
+    static const size_t kInitialSize = 1 << 16;
+
+    int fd_ = -1;
+    uint8_t *data_ = nullptr;
+    size_t mapped_size_ = 0;
+    size_t checkpoint_interval_;
+    size_t updates_since_checkpoint_ = 0;
+    bool has_checkpoint_ = false;
+    bool is_durable_;
+    std::vector<uint8_t> scratch_;
+    std::mutex lock_;
+
+  public:
+
+    // Opens (or creates) the journal at 'path'; check 'isOpen' for failures.
+    Journal(const std::string &path, size_t checkpoint_interval = 64, bool durable = false):
+        checkpoint_interval_(std::max<size_t>(checkpoint_interval, 1)),
+        is_durable_(durable) {
+      fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd_ < 0) return;
+      struct stat info;
+      if (fstat(fd_, &info) != 0) {
+        close();
+        return;
+      }
+      auto is_new = info.st_size < static_cast<off_t>(kHeaderSize);
+      if (!map(is_new ? kInitialSize : static_cast<size_t>(info.st_size))) {
+        close();
+        return;
+      }
+      if (is_new) {
+        memcpy(data_, "LBJR", 4);
+        put<uint32_t>(4, kFormatVersion);
+        put<uint64_t>(8, kHeaderSize);
+        put<uint64_t>(16, 0);
+        put<uint64_t>(24, 0);
+      } else if (memcmp(data_, "LBJR", 4) != 0 || get<uint32_t>(4) != kFormatVersion ||
+                 get<uint64_t>(8) > mapped_size_) {
+        close();
+        return;
+      }
+      has_checkpoint_ = get<uint64_t>(16) != 0;
+    }
+
+    ~Journal() {
+      close();
+    }
+
+    bool isOpen() const {
+      return data_ != nullptr;
+    }
+
+    // Flushes the mapped pages to the file.
+    void sync() {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (data_) msync(data_, mapped_size_, MS_SYNC);
+    }
+
+    // Rebuilds the latest collection from the last checkpoint and the scripts
+    // that follow it. Returns false if the journal is empty or corrupted.
+    bool replay(std::vector<T> &collection, uint64_t &version) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (!data_ || !has_checkpoint_) return false;
+      auto offset = static_cast<size_t>(get<uint64_t>(16));
+      auto tail = static_cast<size_t>(get<uint64_t>(8));
+      if (offset < kHeaderSize || offset >= tail || tail > mapped_size_) return false;
+      std::vector<T> result;
+      std::vector<Diff<T>> diffs;
+      for (auto is_first = true; offset < tail; is_first = false) {
+        if (offset + kRecordHeaderSize > tail) return false;
+        auto kind = get<uint32_t>(offset);
+        auto length = get<uint32_t>(offset + 4);
+        version = get<uint64_t>(offset + 8);
+        auto payload = data_ + offset + kRecordHeaderSize;
+        if (offset + kRecordHeaderSize + length > tail) return false;
+        if (is_first) {
+          if (kind != SNAPSHOT || !decodeSnapshot<T, C>(payload, length, result)) return false;
+        } else if (kind == SCRIPT) {
+          diffs.clear();
+          if (!decodeScript<T, C>(payload, length, diffs) || !isApplicable(diffs, result.size())) return false;
+          apply(result, diffs);
+        }
+        offset += padded(kRecordHeaderSize + length);
+      }
+      collection.swap(result);
+      return true;
+    }
+
+    // Restores 'buffer' to the latest journaled state. The journal can then be
+    // attached to the buffer with 'addUpdateListener'.
+    bool restore(Buffer<T> &buffer) {
+      std::vector<T> collection;
+      uint64_t version = 0;
+      if (!replay(collection, version)) return false;
+      buffer.restoreCollection(std::move(collection), version);
+      return true;
+    }
+
+    virtual void onBufferUpdate(const Update<T> &update) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (!data_) return;
+      if (!update.diffs) {
+        // the buffer was restored from this journal.
+        if (has_checkpoint_ && get<uint64_t>(24) == update.version) return;
+        return checkpoint(update);
+      }
+      scratch_.clear();
+      encodeScript<T, C>(*update.diffs, scratch_);
+      append(SCRIPT, update.version);
+      if (++updates_since_checkpoint_ >= checkpoint_interval_)
+        checkpoint(update);
+    }
+
+  private:
+
+    void checkpoint(const Update<T> &update) {
+      scratch_.clear();
+      encodeSnapshot<T, C>(*update.collection, scratch_);
+      auto offset = append(SNAPSHOT, update.version);
+      if (!offset) return;
+      put<uint64_t>(16, offset);
+      flush(0, kHeaderSize);
+      has_checkpoint_ = true;
+      updates_since_checkpoint_ = 0;
+    }
+
+    // Appends 'scratch_' as a record, returns its offset (or 0 on failure).
+    size_t append(EncodingKind kind, uint64_t version) {
+      auto offset = static_cast<size_t>(get<uint64_t>(8));
+      auto size = padded(kRecordHeaderSize + scratch_.size());
+      if (offset + size > mapped_size_ && !map(std::max(mapped_size_ * 2, offset + size))) return 0;
+      put<uint32_t>(offset, kind);
+      put<uint32_t>(offset + 4, static_cast<uint32_t>(scratch_.size()));
+      put<uint64_t>(offset + 8, version);
+      memcpy(data_ + offset + kRecordHeaderSize, scratch_.data(), scratch_.size());
+      // the record must be on disk before the header pointing past it.
+      if (!flush(offset, size)) return 0;
+      // publishes the record.
+      put<uint64_t>(8, offset + size);
+      put<uint64_t>(24, version);
+      flush(0, kHeaderSize);
+      return offset;
+    }
+
+    // Writes the pages holding [offset, offset + size) to disk when durable.
+    bool flush(size_t offset, size_t size) {
+      if (!is_durable_) return true;
+      auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      auto begin = offset / page * page;
+      return msync(data_ + begin, offset + size - begin, MS_SYNC) == 0;
+    }
+
+    // Grows the file to 'size' bytes and maps it.
+    bool map(size_t size) {
+      if (data_) munmap(data_, mapped_size_);
+      data_ = nullptr;
+      if (ftruncate(fd_, static_cast<off_t>(size)) != 0) return false;
+      auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      if (data == MAP_FAILED) return false;
+      data_ = static_cast<uint8_t*>(data);
+      mapped_size_ = size;
+      return true;
+    }
+
+    void close() {
+      if (data_) munmap(data_, mapped_size_);
+      if (fd_ >= 0) ::close(fd_);
+      data_ = nullptr;
+      fd_ = -1;
+    }
+
+    static size_t padded(size_t size) {
+      return (size + 7) & ~static_cast<size_t>(7);
+    }
+
+    template <typename V>
+    V get(size_t offset) const {
+      V value;
+      memcpy(&value, data_ + offset, sizeof(V));
+      return value;
+    }
+
+    template <typename V>
+    void put(size_t offset, V value) {
+      memcpy(data_ + offset, &value, sizeof(V));
+    }
+  };
+}
+
+#endif /* journal_h */
@@ -54,13 +54,7 @@ int main(int argc, const char * argv[]) {
   Foo sub;
   buffer::Buffer<int> buffer;
 
-  auto sort = [](const std::vector<int> &v) {
-    auto s = std::vector<int>(v);
-    std::sort(s.begin(), s.end(), std::less_equal<int>());
-    return s;
-  };
-
-  buffer.setSortFunction(sort);
+  buffer.setSortComparator(std::less<int>());
   buffer.registerSubscriber(sub);
   buffer.setCollection(o);
   buffer.setCollection(n);
@@ -0,0 +1,171 @@
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+namespace buffer {
+
+  // A histogram of non-negative values (e.g. latencies in nanoseconds) with
+  // HDR-style log-linear buckets: every power of two is split in 16 buckets,
+  // so any recorded value is known within 1/16 of its magnitude, from 1ns to
+  // centuries, in a fixed amount of memory.
+  //
+  // Recording is a couple of relaxed atomic increments on a shard private to
+  // the calling thread (in practice), so it never blocks and the readers never
+  // block it: 'snapshot' merges the shards without any lock.
+  class Histogram {
+  public:
+    static const size_t kSubBuckets = 16;
+    static const size_t kBuckets = (64 - 3) * kSubBuckets;
+    static const size_t kShards = 4;
+
+    // A consistent-enough copy of the histogram.
+    struct Snapshot {
+      std::vector<uint64_t> buckets;
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      uint64_t max = 0;
+
+      double mean() const {
+        return count ? static_cast<double>(sum) / count : 0;
+      }
+
+      // The value below which 'percentile' percent of the values fall, e.g.
+      // 'percentile(99)'.
+      uint64_t percentile(double percentile) const {
+        if (!count) return 0;
+        auto rank = static_cast<uint64_t>(percentile / 100 * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+          seen += buckets[b];
+          if (seen >= rank) return std::min(Histogram::upperBound(b), max);
+        }
+        return max;
+      }
+    };
+
+  private:
+    struct Shard {
+      std::atomic<uint64_t> buckets[kBuckets];
+      std::atomic<uint64_t> sum;
+      std::atomic<uint64_t> max;
+    };
+
+    std::unique_ptr<Shard[]> shards_;
+
+  public:
+
+    Histogram(): shards_(new Shard[kShards]()) {}
+
+    void record(uint64_t value) {
+      auto &shard = shards_[threadShard()];
+      shard.buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+      shard.sum.fetch_add(value, std::memory_order_relaxed);
+      auto max = shard.max.load(std::memory_order_relaxed);
+      while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    Snapshot snapshot() const {
+      Snapshot result;
+      result.buckets.resize(kBuckets);
+      for (size_t s = 0; s < kShards; s++) {
+        auto &shard = shards_[s];
+        for (size_t b = 0; b < kBuckets; b++) {
+          auto count = shard.buckets[b].load(std::memory_order_relaxed);
+          result.buckets[b] += count;
+          result.count += count;
+        }
+        result.sum += shard.sum.load(std::memory_order_relaxed);
+        result.max = std::max(result.max, shard.max.load(std::memory_order_relaxed));
+      }
+      return result;
+    }
+
+    // The bucket of 'value': the values below 16 have their own bucket, the
+    // others are indexed by their magnitude and their next 4 bits.
+    static size_t bucket(uint64_t value) {
+      if (value < kSubBuckets) return static_cast<size_t>(value);
+      auto magnitude = 63 - static_cast<size_t>(__builtin_clzll(value));
+      auto sub_bucket = static_cast<size_t>(value >> (magnitude - 4)) & (kSubBuckets - 1);
+      return (magnitude - 3) * kSubBuckets + sub_bucket;
+    }
+
+    // The largest value that falls in 'bucket'.
+    static uint64_t upperBound(size_t bucket) {
+      if (bucket < kSubBuckets) return bucket;
+      auto magnitude = bucket / kSubBuckets + 3;
+      auto sub_bucket = bucket % kSubBuckets;
+      return ((kSubBuckets + sub_bucket + 1) << (magnitude - 4)) - 1;
+    }
+
+  private:
+
+    // The threads are spread over the shards in turn.
+    static size_t threadShard() {
+      static std::atomic<size_t> next(0);
+      static thread_local size_t shard = next++ % kShards;
+      return shard;
+    }
+  };
+
+  // Instrumentation of a buffer, enabled with 'Buffer::setMetrics'.
+  // All the latencies are in nanoseconds.
+  struct Metrics {
+    typedef std::chrono::steady_clock Clock;
+
+    // The phases of an update.
+    Histogram sort;         // Copying (and sorting) the new collection.
+    Histogram diff;         // Computing the changes (and delivering them, when streaming).
+    Histogram publish;      // Publishing the new collection.
+    Histogram dispatch;     // Notifying the synchronous subscribers.
+    Histogram listeners;    // Notifying the update listeners and feeding the queues.
+
+    Histogram edits;        // The number of changes per update.
+    Histogram queue_depth;  // The updates pending in a queue after every push.
+
+    std::atomic<uint64_t> updates{0};    // The updates that changed the collection.
+    std::atomic<uint64_t> coalesced{0};  // The collections superseded before being diffed.
+
+    // The histogram of the time spent in the callbacks of 'subscriber'.
+    std::shared_ptr<Histogram> subscriber(const void *subscriber) {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto &histogram = subscribers_[subscriber];
+      if (!histogram) histogram = std::make_shared<Histogram>();
+      return histogram;
+    }
+
+    // The callback times of every subscriber seen so far, per update.
+    std::vector<std::pair<const void*, Histogram::Snapshot>> subscribers() const {
+      lock_.lock();
+      auto histograms = std::vector<std::pair<const void*, std::shared_ptr<Histogram>>>(subscribers_.begin(), subscribers_.end());
+      lock_.unlock();
+      std::vector<std::pair<const void*, Histogram::Snapshot>> result;
+      for (auto &histogram : histograms)
+        result.push_back(std::make_pair(histogram.first, histogram.second->snapshot()));
+      return result;
+    }
+
+    // The nanoseconds elapsed since 'mark', which is moved to now.
+    static uint64_t lap(Clock::time_point &mark) {
+      auto now = Clock::now();
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - mark).count();
+      mark = now;
+      return static_cast<uint64_t>(elapsed);
+    }
+
+  private:
+    mutable std::mutex lock_;
+    std::unordered_map<const void*, std::shared_ptr<Histogram>> subscribers_;
+  };
+}
+
+#endif /* metrics_h */
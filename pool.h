@@ -0,0 +1,132 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace buffer {
+
+  // Recycles the vectors backing the published collections.
+  //
+  // A vector shared through the pool comes back to it, emptied but with its
+  // capacity, once the last reference to it is dropped (e.g. by a reader
+  // holding an old snapshot), so successive collections of similar size reuse
+  // the same memory instead of reallocating it. With the published collection
+  // and the one being built that makes for a triple buffering scheme.
+  // The control blocks of the shared pointers are recycled the same way, so
+  // sharing a collection allocates nothing once the pool is warm.
+  // Shared vectors may outlive the pool: they are then simply deleted.
+  template <typename T>
+  class VectorPool {
+  private:
+    struct State {
+      std::mutex lock;
+      std::vector<std::vector<T>*> vectors;
+      std::vector<void*> blocks;   // Retired control blocks, all of 'block_size' bytes.
+      size_t block_size = 0;
+      size_t capacity;
+
+      ~State() {
+        for (auto vector : vectors) delete vector;
+        for (auto block : blocks) ::operator delete(block);
+      }
+    };
+
+    // Allocator of the control blocks, drawing from the retired ones.
+    template <typename U>
+    struct BlockAllocator {
+      typedef U value_type;
+      std::weak_ptr<State> state;
+
+      explicit BlockAllocator(const std::weak_ptr<State> &state): state(state) {}
+
+      template <typename V>
+      BlockAllocator(const BlockAllocator<V> &other): state(other.state) {}
+
+      U *allocate(size_t count) {
+        auto state = this->state.lock();
+        if (state && count == 1) {
+          std::lock_guard<std::mutex> lock(state->lock);
+          if (!state->blocks.empty() && state->block_size == sizeof(U)) {
+            auto block = state->blocks.back();
+            state->blocks.pop_back();
+            return static_cast<U*>(block);
+          }
+        }
+        return static_cast<U*>(::operator new(count * sizeof(U)));
+      }
+
+      void deallocate(U *block, size_t count) {
+        auto state = this->state.lock();
+        if (state && count == 1) {
+          std::lock_guard<std::mutex> lock(state->lock);
+          if (state->blocks.empty()) state->block_size = sizeof(U);
+          // 'blocks' has the capacity reserved, so this never allocates.
+          if (state->block_size == sizeof(U) && state->blocks.size() < state->blocks.capacity()) {
+            state->blocks.push_back(block);
+            return;
+          }
+        }
+        ::operator delete(block);
+      }
+
+      template <typename V>
+      bool operator==(const BlockAllocator<V> &other) const {
+        return !state.owner_before(other.state) && !other.state.owner_before(state);
+      }
+
+      template <typename V>
+      bool operator!=(const BlockAllocator<V> &other) const {
+        return !(*this == other);
+      }
+    };
+
+    std::shared_ptr<State> state_;
+
+  public:
+
+    // Retains at most 'capacity' retired vectors.
+    explicit VectorPool(size_t capacity = 2): state_(std::make_shared<State>()) {
+      state_->capacity = capacity;
+      // the published collection, the ones being read and the one being built.
+      state_->blocks.reserve(capacity + 2);
+    }
+
+    // An empty vector, with the capacity of a retired one when available.
+    std::unique_ptr<std::vector<T>> acquire() {
+      std::lock_guard<std::mutex> lock(state_->lock);
+      if (state_->vectors.empty()) return std::unique_ptr<std::vector<T>>(new std::vector<T>());
+      auto vector = state_->vectors.back();
+      state_->vectors.pop_back();
+      return std::unique_ptr<std::vector<T>>(vector);
+    }
+
+    // Shares 'vector' as an immutable collection; it returns to the pool when
+    // the last reference is dropped.
+    std::shared_ptr<const std::vector<T>> share(std::unique_ptr<std::vector<T>> vector) {
+      std::weak_ptr<State> state = state_;
+      return std::shared_ptr<const std::vector<T>>(vector.release(), [state](const std::vector<T> *retired) {
+        recycle(state.lock(), std::unique_ptr<std::vector<T>>(const_cast<std::vector<T>*>(retired)));
+      }, BlockAllocator<std::vector<T>>(state));
+    }
+
+    // Returns a vector that was never shared to the pool.
+    void recycle(std::unique_ptr<std::vector<T>> vector) {
+      recycle(state_, std::move(vector));
+    }
+
+  private:
+
+    static void recycle(const std::shared_ptr<State> &state, std::unique_ptr<std::vector<T>> vector) {
+      if (!state) return;
+      // the elements are destroyed outside of the lock.
+      vector->clear();
+      std::lock_guard<std::mutex> lock(state->lock);
+      if (state->vectors.size() < state->capacity) state->vectors.push_back(vector.release());
+    }
+  };
+}
+
+#endif /* pool_h */
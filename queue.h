@@ -0,0 +1,251 @@
+#ifndef queue_h
+#define queue_h
+
+#include "diff.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+namespace buffer {
+
+  // What a delivery queue does when an update arrives and the queue is full.
+  enum OverflowPolicy {
+    BLOCK,      // The producer waits for the consumer to catch up.
+    DROP,       // The update is discarded; the consumer later gets a reset.
+    COLLAPSE    // The queued updates are compacted into a single one.
+  };
+
+  // A set of changes published by a buffer.
+  template <typename T>
+  struct Update {
+    uint64_t version;                                   // The version of the buffer after the update.
+    std::shared_ptr<const std::vector<Diff<T>>> diffs;  // The changes, or null for a reset.
+    std::shared_ptr<const std::vector<T>> collection;   // The collection after the update.
+  };
+
+  // A bounded queue that delivers the updates of a buffer to a consumer on a
+  // dedicated thread or on a user supplied executor, isolating the producer
+  // (and the other subscribers) from slow consumers.
+  // A consumer that falls behind receives all of its pending updates at once,
+  // compacted into a single net script (or a reset, when that is smaller).
+  template <typename T>
+  class DeliveryQueue: public std::enable_shared_from_this<DeliveryQueue<T>> {
+  public:
+    typedef std::function<void (std::function<void ()>)> Executor;
+    typedef std::function<void (const Update<T> &)> Consumer;
+
+  private:
+    std::deque<Update<T>> updates_;
+    Update<T> dropped_update_{};
+    std::mutex lock_;
+    std::condition_variable changed_;
+    std::thread worker_;
+    std::thread::id draining_thread_;
+    Consumer consumer_ = nullptr;
+    Executor executor_ = nullptr;
+    size_t capacity_;
+    OverflowPolicy policy_;
+    size_t dropped_ = 0;
+
+    // flags.
+    bool is_closed_ = false;
+    bool is_draining_ = false;
+    bool is_paused_ = false;
+    bool needs_reset_ = false;
+
+  public:
+
+    // When 'executor' is null the updates are delivered on a dedicated thread.
+    DeliveryQueue(size_t capacity = 64, OverflowPolicy policy = BLOCK, Executor executor = nullptr):
+        executor_(executor), capacity_(std::max<size_t>(capacity, 1)), policy_(policy) {}
+
+    ~DeliveryQueue() {
+      close();
+    }
+
+    // Starts delivering the queued updates to 'consumer'.
+    void start(Consumer consumer) {
+      std::unique_lock<std::mutex> lock(lock_);
+      consumer_ = consumer;
+      if (!executor_ && !worker_.joinable())
+        worker_ = std::thread(&DeliveryQueue::run, this);
+      auto should_schedule = executor_ && claim();
+      lock.unlock();
+      if (should_schedule) schedule();
+    }
+
+    // Discards the pending updates and waits for the delivery in flight, if any
+    // (unless called by the consumer, from the delivery itself).
+    void close() {
+      std::unique_lock<std::mutex> lock(lock_);
+      is_closed_ = true;
+      updates_.clear();
+      changed_.notify_all();
+      auto is_worker = worker_.get_id() == std::this_thread::get_id();
+      auto is_consumer = is_draining_ && draining_thread_ == std::this_thread::get_id();
+      if (!is_worker && !is_consumer)
+        changed_.wait(lock, [this]() { return !is_draining_; });
+      lock.unlock();
+      if (worker_.joinable()) {
+        if (is_worker) worker_.detach();
+        else worker_.join();
+      }
+    }
+
+    // Suspends the delivery; the updates keep being queued (and compacted when
+    // the queue overflows with the COLLAPSE policy).
+    void pause() {
+      std::lock_guard<std::mutex> lock(lock_);
+      is_paused_ = true;
+    }
+
+    // Resumes the delivery, catching up with the pending updates in one pass.
+    void resume() {
+      std::unique_lock<std::mutex> lock(lock_);
+      is_paused_ = false;
+      changed_.notify_all();
+      auto should_schedule = executor_ && claim();
+      lock.unlock();
+      if (should_schedule) schedule();
+    }
+
+    // Enqueues an update, applying the overflow policy when the queue is full.
+    void push(Update<T> update) {
+      std::unique_lock<std::mutex> lock(lock_);
+      if (is_closed_) return;
+      if (updates_.size() >= capacity_) {
+        switch (policy_) {
+          case BLOCK:
+            changed_.wait(lock, [this]() { return updates_.size() < capacity_ || is_closed_; });
+            if (is_closed_) return;
+            break;
+          case DROP:
+            dropped_++;
+            dropped_update_ = std::move(update);
+            needs_reset_ = true;
+            return;
+          case COLLAPSE:
+            dropped_ += updates_.size();
+            updates_.push_back(std::move(update));
+            update = compact(updates_);
+            break;
+        }
+      }
+      // a consumer that missed some updates is resynchronized with a snapshot.
+      if (needs_reset_) {
+        update.diffs = nullptr;
+        dropped_update_ = Update<T>{};
+        needs_reset_ = false;
+      }
+      updates_.push_back(std::move(update));
+      changed_.notify_all();
+      auto should_schedule = executor_ && claim();
+      lock.unlock();
+      if (should_schedule) schedule();
+    }
+
+    // The number of updates waiting to be delivered.
+    size_t size() {
+      std::lock_guard<std::mutex> lock(lock_);
+      return updates_.size();
+    }
+
+    // The number of updates discarded or merged because of the overflow policy.
+    size_t dropped() {
+      std::lock_guard<std::mutex> lock(lock_);
+      return dropped_;
+    }
+
+  private:
+
+    // Merges (and removes) the given updates into a single one: the scripts are
+    // composed into a net script, which falls back to a reset when it is larger
+    // than the collection itself.
+    static Update<T> compact(std::deque<Update<T>> &updates) {
+      auto result = std::move(updates.front());
+      updates.pop_front();
+      for (; !updates.empty(); updates.pop_front()) {
+        auto &next = updates.front();
+        if (result.diffs && next.diffs) {
+          auto composed = compose(*result.diffs, *next.diffs);
+          result.diffs = composed.size() > next.collection->size()
+              ? nullptr
+              : std::make_shared<const std::vector<Diff<T>>>(std::move(composed));
+        } else {
+          result.diffs = nullptr;
+        }
+        result.version = next.version;
+        result.collection = std::move(next.collection);
+      }
+      return result;
+    }
+
+    // Queues a reset to the last dropped update once the consumer caught up, so
+    // that it is not left behind when no other update follows. Must be called
+    // with 'lock_' held.
+    void recover() {
+      if (!needs_reset_ || !updates_.empty()) return;
+      dropped_update_.diffs = nullptr;
+      updates_.push_back(std::move(dropped_update_));
+      dropped_update_ = Update<T>{};
+      needs_reset_ = false;
+    }
+
+    // Whether a drain should be posted to the executor. Must be called with
+    // 'lock_' held.
+    bool claim() {
+      if (is_draining_ || is_paused_ || is_closed_ || updates_.empty() || !consumer_) return false;
+      is_draining_ = true;
+      return true;
+    }
+
+    void schedule() {
+      auto self = this->shared_from_this();
+      executor_([self]() { self->drain(); });
+    }
+
+    // Delivers the queued updates on the executor until the queue is empty.
+    void drain() {
+      std::unique_lock<std::mutex> lock(lock_);
+      draining_thread_ = std::this_thread::get_id();
+      while (!is_closed_ && !is_paused_ && !updates_.empty()) {
+        auto update = compact(updates_);
+        changed_.notify_all();
+        lock.unlock();
+        consumer_(update);
+        lock.lock();
+        recover();
+      }
+      is_draining_ = false;
+      changed_.notify_all();
+    }
+
+    // The body of the dedicated delivery thread.
+    void run() {
+      std::unique_lock<std::mutex> lock(lock_);
+      while (true) {
+        changed_.wait(lock, [this]() { return is_closed_ || (!is_paused_ && !updates_.empty()); });
+        if (is_closed_) break;
+        auto update = compact(updates_);
+        is_draining_ = true;
+        draining_thread_ = std::this_thread::get_id();
+        changed_.notify_all();
+        lock.unlock();
+        consumer_(update);
+        lock.lock();
+        recover();
+        is_draining_ = false;
+        changed_.notify_all();
+      }
+    }
+  };
+}
+
+#endif /* queue_h */
@@ -0,0 +1,207 @@
+#ifndef script_h
+#define script_h
+
+#include "diff.h"
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+
+namespace buffer {
+
+  // Operations over the edit scripts returned by 'diff'.
+  //
+  // A script is in canonical form when its indices are non-increasing and, for
+  // a given index, a deletion or substitution comes before the insertions. The
+  // indices of a canonical script are then positions in the *source*
+  // collection: INSERT at 'i' adds an element right before the i-th source
+  // element, DELETE and SUBSTITUTE at 'i' target the i-th source element.
+  // Walking such a script in reverse visits the edits in ascending order.
+
+  // Every function expects the 'previous' field of the diffs to be set, as
+  // 'diff' does.
+
+  // Composes the script 'first' (x -> y) with the script 'second' (y -> z) into
+  // a single canonical script x -> z, in O(|first| + |second|).
+  // Insertions that are later deleted cancel out and substitutions collapse.
+  template <typename T>
+  std::vector<Diff<T>> compose(const std::vector<Diff<T>> &first, const std::vector<Diff<T>> &second) {
+    std::vector<Diff<T>> result;
+    result.reserve(first.size() + second.size());
+
+    auto e1 = first.rbegin();
+    auto e2 = second.rbegin();
+    // the offset between the position in 'y' and the position in 'x' of the
+    // elements that 'first' leaves in place.
+    long shift = 0;
+
+    while (e1 != first.rend() || e2 != second.rend()) {
+      // the position in 'y' that the next edit of 'first' refers to.
+      auto y1 = e1 != first.rend() ? static_cast<long>(e1->index) + shift : 0;
+      auto y2 = e2 != second.rend() ? static_cast<long>(e2->index) : 0;
+
+      // a deleted source element is invisible to 'second'.
+      if (e1 != first.rend() && e1->type == DELETE && (e2 == second.rend() || y1 <= y2)) {
+        result.push_back(*e1);
+        shift--;
+        ++e1;
+        continue;
+      }
+
+      // 'second' edits an element that 'first' left in place, or inserts
+      // right before one of the elements of 'y'.
+      if (e2 != second.rend() && (e1 == first.rend() || y2 < y1 || (y2 == y1 && e2->type == INSERT))) {
+        result.push_back(Diff<T>{e2->type, static_cast<size_t>(y2 - shift), e2->value, e2->previous});
+        ++e2;
+        continue;
+      }
+
+      // 'first' inserts or substitutes an element, which 'second' may edit.
+      auto composed = *e1;
+      auto is_cancelled = false;
+      if (e2 != second.rend() && y2 == y1) {
+        if (e2->type == DELETE) {
+          // a deletion removes the value the source collection had.
+          is_cancelled = e1->type == INSERT;
+          composed.type = DELETE;
+          composed.value = composed.previous;
+        } else {
+          composed.value = e2->value;
+          if (composed.type == INSERT) composed.previous = composed.value;
+        }
+        ++e2;
+      }
+      if (!is_cancelled) result.push_back(composed);
+      if (e1->type == INSERT) shift++;
+      ++e1;
+    }
+
+    // back to canonical (descending) order.
+    std::reverse(result.begin(), result.end());
+    return result;
+  }
+
+  // Returns the script that undoes 'diffs' (y -> x), in O(|diffs|).
+  template <typename T>
+  std::vector<Diff<T>> invert(const std::vector<Diff<T>> &diffs) {
+    std::vector<Diff<T>> result;
+    result.reserve(diffs.size());
+    // the offset between the position in 'y' and the position in 'x'.
+    long shift = 0;
+    for (auto d = diffs.rbegin(); d != diffs.rend(); ++d) {
+      auto index = static_cast<size_t>(static_cast<long>(d->index) + shift);
+      switch (d->type) {
+        case INSERT:
+          result.push_back(Diff<T>{DELETE, index, d->value, d->value});
+          shift++;
+          break;
+        case DELETE:
+          result.push_back(Diff<T>{INSERT, index, d->previous, d->previous});
+          shift--;
+          break;
+        default:
+          result.push_back(Diff<T>{d->type, index, d->previous, d->value});
+          break;
+      }
+    }
+    std::reverse(result.begin(), result.end());
+    return result;
+  }
+
+  // Rewrites a script whose operations are meant to be applied one after the
+  // other, in any order, into the equivalent canonical script: insertions that
+  // are later deleted cancel out, a deletion and an insertion at the same
+  // position become a substitution and no-op substitutions are dropped.
+  // Runs in O(|diffs|) for scripts that are already sorted, and in O(|diffs| * r)
+  // for scripts made of 'r' sorted runs.
+  template <typename T>
+  std::vector<Diff<T>> normalize(const std::vector<Diff<T>> &diffs) {
+    std::vector<Diff<T>> result;
+    std::vector<Diff<T>> run;
+    for (size_t k = 0; k <= diffs.size(); k++) {
+      // a run ends when an operation does not apply to the source positions:
+      // it targets a later position, or an element edited within the run.
+      auto is_run_end = k == diffs.size() || (!run.empty() &&
+          (diffs[k].index > run.back().index ||
+           (diffs[k].index == run.back().index && diffs[k].type != INSERT)));
+      if (is_run_end && !run.empty()) {
+        result = result.empty() ? run : compose(result, run);
+        run.clear();
+      }
+      if (k < diffs.size()) run.push_back(diffs[k]);
+    }
+
+    // coalesces deletions and insertions at the same position.
+    std::vector<Diff<T>> list;
+    list.reserve(result.size());
+    for (size_t k = 0; k < result.size(); k++) {
+      auto d = result[k];
+      if (d.type == DELETE && k + 1 < result.size() &&
+          result[k+1].type == INSERT && result[k+1].index == d.index) {
+        d = Diff<T>{SUBSTITUTE, d.index, result[k+1].value, d.previous};
+        k++;
+      }
+      if (d.type == SUBSTITUTE && d.value == d.previous) continue;
+      list.push_back(d);
+    }
+    return list;
+  }
+
+  // Whether 'diffs' is a canonical script whose edits fall within a collection
+  // of 'size' elements, i.e. one 'apply' can take. Scripts read from a file or
+  // received from another process should be checked before being applied.
+  template <typename T>
+  bool isApplicable(const std::vector<Diff<T>> &diffs, size_t size) {
+    for (size_t k = 0; k < diffs.size(); k++) {
+      auto &d = diffs[k];
+      if (d.type == INSERT ? d.index > size : d.index >= size) return false;
+      if (k && (d.index > diffs[k-1].index || (d.index == diffs[k-1].index && d.type != INSERT))) return false;
+    }
+    return true;
+  }
+
+  // Applies a canonical script to 'collection' in place, in O(n + k).
+  // The deletions and substitutions are applied by compacting the collection
+  // front to back and the insertions by spreading it back to front, so that
+  // every element is moved at most once per pass (instead of once per edit).
+  // Scripts assembled by hand should go through 'normalize' first.
+  template <typename T>
+  void apply(std::vector<T> &collection, const std::vector<Diff<T>> &diffs) {
+    // the insertions, with their position in the compacted collection.
+    std::vector<std::pair<size_t, const T*>> insertions;
+    size_t deleted = 0;
+    size_t next = 0;
+    for (auto d = diffs.rbegin(); d != diffs.rend(); ++d) {
+      if (d->type == INSERT) {
+        insertions.push_back(std::make_pair(d->index - deleted, &d->value));
+        continue;
+      }
+      assert(d->index < collection.size());
+      if (deleted)
+        std::move(collection.begin() + next, collection.begin() + d->index, collection.begin() + (next - deleted));
+      next = d->index + 1;
+      if (d->type == DELETE) deleted++;
+      else collection[d->index - deleted] = d->value;
+    }
+    if (deleted) {
+      std::move(collection.begin() + next, collection.end(), collection.begin() + (next - deleted));
+      collection.erase(collection.end() - deleted, collection.end());
+    }
+    if (insertions.empty()) return;
+
+    // makes room at the end, then moves the elements back to their final slot.
+    auto read = collection.size();
+    collection.reserve(read + insertions.size());
+    for (auto &insertion : insertions) collection.push_back(*insertion.second);
+    auto write = collection.size();
+    for (auto k = insertions.size(); k-- > 0;) {
+      auto position = insertions[k].first;
+      std::move_backward(collection.begin() + position, collection.begin() + read, collection.begin() + write);
+      write -= read - position;
+      read = position;
+      collection[--write] = *insertions[k].second;
+    }
+  }
+}
+
+#endif /* script_h */
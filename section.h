@@ -0,0 +1,306 @@
+#ifndef section_h
+#define section_h
+
+#include "diff.h"
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <assert.h>
+
+namespace buffer {
+
+  // A group of rows and the model describing it (e.g. the section header).
+  template <typename S, typename T>
+  struct Section {
+    S section;              // The section model.
+    std::vector<T> rows;    // The rows contained in this section.
+  };
+
+  // The position of a row in a sectioned collection.
+  struct IndexPath {
+    size_t section;
+    size_t row;
+  };
+
+  // Interface of a sectioned buffer subscriber.
+  // Row changes are delivered first, addressed with the section index *before*
+  // the update; section changes follow as an edit script over the section list.
+  template <typename S, typename T>
+  class SectionedSubscriber {
+  public:
+    virtual void onBufferWillChange() = 0;
+    virtual void onBufferDidChange() = 0;
+
+    // Callback called whenever a section is inserted, deleted or replaced.
+    virtual void onSectionChange(DiffType type, size_t section, const Section<S, T> &value) = 0;
+
+    // Callback called whenever a row of a section that is kept changes.
+    virtual void onRowChange(DiffType type, IndexPath index_path, T value) = 0;
+  };
+
+  // Returns the (x, y) index pairs of the elements that an edit script produced
+  // by 'diff' leaves in place.
+  template <typename T>
+  std::vector<std::pair<size_t, size_t>> matches(const std::vector<Diff<T>> &diffs, size_t x_size) {
+    std::vector<std::pair<size_t, size_t>> result;
+    size_t i = 0, j = 0;
+    // the script is applied back to front, hence it is walked in reverse.
+    for (auto d = diffs.rbegin(); d != diffs.rend(); ++d) {
+      for (; i < d->index; i++, j++) result.push_back(std::make_pair(i, j));
+      switch (d->type) {
+        case INSERT: j++; break;
+        case DELETE: i++; break;
+        default: i++; j++; break;
+      }
+    }
+    for (; i < x_size; i++, j++) result.push_back(std::make_pair(i, j));
+    return result;
+  }
+
+  // A buffer of sections that diffs the section list first (by key) and then
+  // diffs the rows of the sections present in both collections.
+  template <typename S, typename T>
+  class SectionedBuffer {
+  private:
+
+    typedef std::vector<Section<S, T>> Collection;
+
+    std::unique_ptr<Collection> back_buffer_{};
+    std::unique_ptr<Collection> front_buffer_{};
+    std::unique_ptr<std::vector<SectionedSubscriber<S, T>*>> subscribers_{};
+    std::mutex buffer_lock_;
+    std::mutex subscribers_lock_;
+
+    // delegate funcs.
+    std::function<bool (S, S)> section_key_fnc_ = nullptr;
+    std::function<bool (T, T)> compare_fnc_ = nullptr;
+
+    // flags.
+    bool is_asynchronous_ = false;
+    bool is_computing_changes_ = false;
+    bool should_recompute_changes_ = false;
+
+    // Sections whose product of row counts is below this are diffed inline.
+    size_t parallel_threshold_ = 1 << 16;
+
+  public:
+
+    SectionedBuffer() {
+      back_buffer_ = std::unique_ptr<Collection>(new Collection());
+      front_buffer_ = std::unique_ptr<Collection>(new Collection());
+      subscribers_ = std::unique_ptr<std::vector<SectionedSubscriber<S, T>*>>(new std::vector<SectionedSubscriber<S, T>*>());
+    }
+
+    // Adds a new subscriber to this buffer.
+    void registerSubscriber(SectionedSubscriber<S, T> &subscriber) {
+      std::lock_guard<std::mutex> lock(subscribers_lock_);
+      if (std::find(subscribers_->begin(), subscribers_->end(), &subscriber) == subscribers_->end())
+        subscribers_->push_back(&subscriber);
+    }
+
+    // Remove the subscriber passed as argument.
+    void unregisterSubscriber(SectionedSubscriber<S, T> &subscriber) {
+      std::lock_guard<std::mutex> lock(subscribers_lock_);
+      subscribers_->erase(std::remove(subscribers_->begin(), subscribers_->end(), &subscriber), subscribers_->end());
+    }
+
+    // Returns all the sections currently exposed from the buffer.
+    Collection getCollection() {
+      std::lock_guard<std::mutex> lock(buffer_lock_);
+      return Collection(*front_buffer_);
+    }
+
+    // Updates the sections, compute the diffs and notifies the subscribers.
+    void setCollection(Collection collection) {
+      back_buffer_ = std::unique_ptr<Collection>(new Collection(std::move(collection)));
+      refresh();
+    }
+
+    void refresh() {
+      if (!is_asynchronous_) {
+        computeChanges();
+      } else {
+        // check if is already applying the changes.
+        if (is_computing_changes_) {
+          should_recompute_changes_ = true;
+          return;
+        }
+        std::thread bkg(&SectionedBuffer::computeChanges, this);
+        bkg.detach();
+      }
+    }
+
+    // Wheter the changes should be computed on a background thread or not.
+    void setAsynchronous(bool asynchronous) {
+      is_asynchronous_ = asynchronous;
+    }
+
+    // Whether two section models identify the same section (defaults to '==').
+    // Sections with the same key have their rows diffed, and are replaced as a
+    // whole only if their models are not equal.
+    void setSectionKeyFunction(const std::function<bool (S, S)> key) {
+      section_key_fnc_ = key;
+    }
+
+    // Override the '==' function for the rows.
+    void setCompareFunction(const std::function<bool (T, T)> compare) {
+      compare_fnc_ = compare;
+    }
+
+    // Sections whose row diff costs less than 'cells' comparisons are not
+    // dispatched to the worker threads.
+    void setParallelThreshold(size_t cells) {
+      parallel_threshold_ = cells;
+    }
+
+  private:
+
+    struct RowChanges {
+      size_t section;               // The index of the section before the update.
+      size_t target;                // The index of the section after the update.
+      std::vector<Diff<T>> diffs;
+    };
+
+    void computeChanges() {
+      buffer_lock_.lock();
+      is_computing_changes_ = true;
+      if (should_recompute_changes_)
+        should_recompute_changes_ = false;
+
+      auto new_collection = new Collection(*back_buffer_);
+      auto &old_sections = *front_buffer_;
+      auto &new_sections = *new_collection;
+
+      // diffs the section list by key.
+      std::vector<S> old_keys, new_keys;
+      for (auto &s : old_sections) old_keys.push_back(s.section);
+      for (auto &s : new_sections) new_keys.push_back(s.section);
+      auto section_diffs = diff(old_keys, new_keys, section_key_fnc_);
+
+      // the sections with a matching key are either reloaded, when their model
+      // changed, or have their rows diffed.
+      std::vector<Diff<Section<S, T>>> section_changes;
+      std::vector<RowChanges> row_changes;
+      std::vector<std::pair<size_t, size_t>> replaced;
+      for (auto &m : matches(section_diffs, old_sections.size())) {
+        if (!(old_sections[m.first].section == new_sections[m.second].section))
+          replaced.push_back(m);
+        else
+          row_changes.push_back(RowChanges{m.first, m.second, {}});
+      }
+      diffRows(old_sections, new_sections, row_changes);
+
+      // maps the section script onto the new sections.
+      mergeSectionChanges(old_sections, new_sections, section_diffs, replaced, section_changes);
+
+      auto is_changed = !section_changes.empty() ||
+          std::any_of(row_changes.begin(), row_changes.end(), [](const RowChanges &c) {
+            return !c.diffs.empty();
+          });
+
+      subscribers_lock_.lock();
+      auto subscribers = *subscribers_;
+      subscribers_lock_.unlock();
+
+      if (is_changed)
+        for (auto subscriber : subscribers)
+          subscriber->onBufferWillChange();
+
+      front_buffer_ = std::unique_ptr<Collection>(new_collection);
+
+      // Propagate the row changes first, then the section changes.
+      for (auto &changes : row_changes)
+        for (auto &diff : changes.diffs)
+          for (auto subscriber : subscribers)
+            subscriber->onRowChange(diff.type, IndexPath{changes.section, diff.index}, diff.value);
+
+      for (auto &diff : section_changes)
+        for (auto subscriber : subscribers)
+          subscriber->onSectionChange(diff.type, diff.index, diff.value);
+
+      if (is_changed)
+        for (auto subscriber : subscribers)
+          subscriber->onBufferDidChange();
+
+      is_computing_changes_ = false;
+      buffer_lock_.unlock();
+
+      // The collection changed while the changes where being computed.
+      if (should_recompute_changes_)
+        computeChanges();
+    }
+
+    // Diffs the rows of every kept section, spreading the expensive sections
+    // across the available cores.
+    void diffRows(const Collection &old_sections,
+                  const Collection &new_sections,
+                  std::vector<RowChanges> &row_changes) {
+      auto diff_rows = [&](RowChanges &changes) {
+        changes.diffs = diff(old_sections[changes.section].rows,
+                             new_sections[changes.target].rows,
+                             compare_fnc_);
+      };
+
+      std::vector<RowChanges*> expensive;
+      for (auto &changes : row_changes) {
+        auto &x = old_sections[changes.section].rows;
+        auto &y = new_sections[changes.target].rows;
+        if (!compare_fnc_ && x == y) continue;
+        if (x.size() * y.size() < parallel_threshold_) diff_rows(changes);
+        else expensive.push_back(&changes);
+      }
+
+      auto workers = std::min<size_t>(expensive.size(), std::max(1u, std::thread::hardware_concurrency()));
+      if (workers <= 1) {
+        for (auto changes : expensive) diff_rows(*changes);
+        return;
+      }
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> threads;
+      for (size_t w = 0; w < workers; w++)
+        threads.push_back(std::thread([&]() {
+          for (auto i = next++; i < expensive.size(); i = next++) diff_rows(*expensive[i]);
+        }));
+      for (auto &thread : threads) thread.join();
+    }
+
+    // Translates the script over the section models into a script over the
+    // sections, and appends a substitution for every reloaded section.
+    void mergeSectionChanges(const Collection &old_sections,
+                             const Collection &new_sections,
+                             const std::vector<Diff<S>> &section_diffs,
+                             const std::vector<std::pair<size_t, size_t>> &replaced,
+                             std::vector<Diff<Section<S, T>>> &result) {
+      // the index in 'new_sections' of every inserted or substituted section.
+      std::vector<size_t> targets(section_diffs.size());
+      long shift = 0;
+      for (auto k = section_diffs.size(); k-- > 0;) {
+        auto &d = section_diffs[k];
+        targets[k] = static_cast<size_t>(static_cast<long>(d.index) + shift);
+        if (d.type == INSERT) shift++;
+        if (d.type == DELETE) shift--;
+      }
+      // reloaded sections are untouched by the script: merge them in order.
+      auto r = replaced.rbegin();
+      for (size_t k = 0; k < section_diffs.size(); k++) {
+        auto &d = section_diffs[k];
+        for (; r != replaced.rend() && r->first >= d.index; ++r)
+          result.push_back(Diff<Section<S, T>>{SUBSTITUTE, r->first, new_sections[r->second], old_sections[r->first]});
+        if (d.type == DELETE)
+          result.push_back(Diff<Section<S, T>>{DELETE, d.index, old_sections[d.index], old_sections[d.index]});
+        else if (d.type == INSERT)
+          result.push_back(Diff<Section<S, T>>{INSERT, d.index, new_sections[targets[k]], new_sections[targets[k]]});
+        else
+          result.push_back(Diff<Section<S, T>>{d.type, d.index, new_sections[targets[k]], old_sections[d.index]});
+      }
+      for (; r != replaced.rend(); ++r)
+        result.push_back(Diff<Section<S, T>>{SUBSTITUTE, r->first, new_sections[r->second], old_sections[r->first]});
+    }
+  };
+}
+
+#endif /* section_h */
@@ -0,0 +1,334 @@
+#ifndef shm_h
+#define shm_h
+
+#include "buffer.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace buffer {
+
+  // Shared-memory transport of the updates of a buffer of trivially copyable
+  // elements, for reader processes on the same host.
+  //
+  // The segment is a header followed by a ring of records (snapshots and
+  // scripts), each one a small header and the raw bytes of the elements (or
+  // of the Diff<T> values). Positions in the ring grow monotonically and the
+  // producer announces the range it is about to overwrite ('reserved') before
+  // writing it, then publishes it ('head'): a reader copies a record and
+  // validates it against 'reserved' afterwards, seqlock style, so it never
+  // blocks the producer. A reader that is lapped resumes from the latest
+  // snapshot. An update too large for the ring is recorded as lost, and the
+  // readers wait for the next snapshot rather than applying the scripts that
+  // follow it.
+  namespace shm {
+
+    static const uint32_t kMagic = 0x4c42534d;  // 'LBSM'
+
+    enum RecordKind { SNAPSHOT = 1, SCRIPT = 2 };
+
+    struct Header {
+      uint32_t magic;
+      uint32_t element_size;
+      uint64_t capacity;                // The size of the ring, in bytes.
+      std::atomic<uint64_t> reserved;   // The end of the range being written.
+      std::atomic<uint64_t> head;       // The end of the published records.
+      std::atomic<uint64_t> snapshot;   // 1 + the position of the latest snapshot, 0 if none.
+      std::atomic<uint64_t> lost;       // The version of the latest update not published.
+    };
+
+    struct Record {
+      uint32_t kind;
+      uint32_t reserved;
+      uint64_t version;
+      uint64_t count;                   // The number of elements or diffs.
+    };
+
+    inline size_t padded(size_t size) {
+      return (size + 7) & ~static_cast<size_t>(7);
+    }
+  }
+
+  // Publishes the updates of a buffer into a POSIX shared memory segment.
+  // Attach it to the buffer with 'addUpdateListener'.
+  template <typename T>
+  class SharedMemoryPublisher: public UpdateListener<T> {
+    static_assert(std::is_trivially_copyable<T>::value, "the elements must be trivially copyable");
+
+  private:
+    std::string name_;
+    shm::Header *header_ = nullptr;
+    uint8_t *ring_ = nullptr;
+    size_t mapped_size_ = 0;
+    size_t snapshot_interval_;
+    size_t updates_since_snapshot_ = 0;
+
+  public:
+
+    // Creates (or replaces) the segment 'name' with a ring of 'capacity' bytes.
+    // A snapshot is published every 'snapshot_interval' updates so that lapped
+    // readers can recover; it must fit in half of the ring.
+    SharedMemoryPublisher(const std::string &name, size_t capacity = 1 << 24, size_t snapshot_interval = 64):
+        name_(name), snapshot_interval_(std::max<size_t>(snapshot_interval, 1)) {
+      shm_unlink(name_.c_str());
+      auto fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (fd < 0) return;
+      capacity = shm::padded(capacity);
+      auto size = sizeof(shm::Header) + capacity;
+      auto data = ftruncate(fd, static_cast<off_t>(size)) == 0
+          ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+          : MAP_FAILED;
+      ::close(fd);
+      if (data == MAP_FAILED) return;
+      mapped_size_ = size;
+      header_ = new (data) shm::Header();
+      header_->element_size = sizeof(T);
+      header_->capacity = capacity;
+      header_->reserved.store(0);
+      header_->head.store(0);
+      header_->snapshot.store(0);
+      header_->lost.store(0);
+      ring_ = static_cast<uint8_t*>(data) + sizeof(shm::Header);
+      // the magic number is the last thing written: readers wait for it.
+      std::atomic_thread_fence(std::memory_order_release);
+      header_->magic = shm::kMagic;
+    }
+
+    ~SharedMemoryPublisher() {
+      if (header_) munmap(header_, mapped_size_);
+      shm_unlink(name_.c_str());
+    }
+
+    bool isOpen() const {
+      return header_ != nullptr;
+    }
+
+    virtual void onBufferUpdate(const Update<T> &update) {
+      if (!header_) return;
+      auto is_snapshot_due = !update.diffs || ++updates_since_snapshot_ >= snapshot_interval_;
+      // a script too large for the ring is replaced by a snapshot.
+      auto is_published = update.diffs && publish(shm::SCRIPT, update.version, update.diffs->data(), update.diffs->size());
+      if (update.diffs && !is_published)
+        is_snapshot_due = true;
+      if (is_snapshot_due) {
+        auto position = header_->head.load(std::memory_order_relaxed);
+        if (publish(shm::SNAPSHOT, update.version, update.collection->data(), update.collection->size())) {
+          header_->snapshot.store(position + 1, std::memory_order_release);
+          updates_since_snapshot_ = 0;
+          is_published = true;
+        }
+      }
+      // neither fits: no snapshot before this update is of any use anymore.
+      // The snapshot is dropped first, so that the readers seeing the loss
+      // cannot resume from it.
+      if (!is_published) {
+        header_->snapshot.store(0, std::memory_order_release);
+        header_->lost.store(update.version, std::memory_order_release);
+      }
+    }
+
+  private:
+
+    template <typename V>
+    bool publish(shm::RecordKind kind, uint64_t version, const V *values, size_t count) {
+      auto size = shm::padded(sizeof(shm::Record) + count * sizeof(V));
+      if (size > header_->capacity / 2) return false;
+      auto position = header_->head.load(std::memory_order_relaxed);
+      header_->reserved.store(position + size, std::memory_order_relaxed);
+      // the readers must see the reservation before any overwritten byte.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto record = shm::Record{static_cast<uint32_t>(kind), 0, version, count};
+      write(position, &record, sizeof(record));
+      write(position + sizeof(record), values, count * sizeof(V));
+      header_->head.store(position + size, std::memory_order_release);
+      return true;
+    }
+
+    void write(uint64_t position, const void *data, size_t size) {
+      // an empty collection has no data to copy (and may be null).
+      if (!size) return;
+      auto offset = static_cast<size_t>(position % header_->capacity);
+      auto first = std::min(size, static_cast<size_t>(header_->capacity) - offset);
+      memcpy(ring_ + offset, data, first);
+      memcpy(ring_, static_cast<const uint8_t*>(data) + first, size - first);
+    }
+  };
+
+  // Reads the updates published by a 'SharedMemoryPublisher' in another
+  // process, maintaining a local copy of the collection.
+  template <typename T>
+  class SharedMemoryReader {
+    static_assert(std::is_trivially_copyable<T>::value, "the elements must be trivially copyable");
+
+  private:
+    const shm::Header *header_ = nullptr;
+    const uint8_t *ring_ = nullptr;
+    size_t mapped_size_ = 0;
+    uint64_t cursor_ = 0;
+    uint64_t version_ = 0;
+    bool is_synchronized_ = false;
+    std::vector<T> collection_;
+    std::vector<Diff<T>> diffs_;
+
+  public:
+
+    explicit SharedMemoryReader(const std::string &name) {
+      auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+      if (fd < 0) return;
+      struct stat info;
+      auto data = fstat(fd, &info) == 0 && info.st_size > static_cast<off_t>(sizeof(shm::Header))
+          ? mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0)
+          : MAP_FAILED;
+      ::close(fd);
+      if (data == MAP_FAILED) return;
+      header_ = static_cast<const shm::Header*>(data);
+      mapped_size_ = static_cast<size_t>(info.st_size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header_->magic != shm::kMagic || header_->element_size != sizeof(T) ||
+          sizeof(shm::Header) + header_->capacity > mapped_size_) {
+        munmap(const_cast<shm::Header*>(header_), mapped_size_);
+        header_ = nullptr;
+        return;
+      }
+      ring_ = static_cast<const uint8_t*>(data) + sizeof(shm::Header);
+    }
+
+    ~SharedMemoryReader() {
+      if (header_) munmap(const_cast<shm::Header*>(header_), mapped_size_);
+    }
+
+    bool isOpen() const {
+      return header_ != nullptr;
+    }
+
+    // The local copy of the collection and its version.
+    const std::vector<T> &getCollection() const {
+      return collection_;
+    }
+
+    uint64_t getVersion() const {
+      return version_;
+    }
+
+    // Consumes the records published since the last call, notifying
+    // 'subscriber' (if any). Returns the number of updates consumed.
+    size_t poll(Subscriber<T> *subscriber = nullptr) {
+      if (!header_) return 0;
+      size_t count = 0;
+      if (!is_synchronized_) {
+        if (!resynchronize(subscriber)) return 0;
+        count++;
+      }
+      while (cursor_ < header_->head.load(std::memory_order_acquire)) {
+        shm::Record record;
+        if (!read(cursor_, &record, sizeof(record))) {
+          if (!resynchronize(subscriber)) break;
+          count++;
+          continue;
+        }
+        auto size = shm::padded(sizeof(record) + record.count * (record.kind == shm::SCRIPT ? sizeof(Diff<T>) : sizeof(T)));
+        if (record.kind == shm::SCRIPT) {
+          diffs_.resize(static_cast<size_t>(record.count));
+          if (!read(cursor_ + sizeof(record), diffs_.data(), diffs_.size() * sizeof(Diff<T>))) {
+            if (!resynchronize(subscriber)) break;
+            count++;
+            continue;
+          }
+          if (record.version > version_ && header_->lost.load(std::memory_order_acquire) > version_) {
+            // an update was lost since the local copy: the script does not
+            // apply to it.
+            if (!resynchronize(subscriber)) break;
+            count++;
+            continue;
+          }
+          if (record.version > version_) {
+            apply(collection_, diffs_);
+            version_ = record.version;
+            notify(subscriber);
+            count++;
+          }
+        } else if (record.version > version_) {
+          // a snapshot published in place of a script too large for the ring.
+          if (!load(cursor_, subscriber) && !resynchronize(subscriber)) break;
+          count++;
+          continue;
+        }
+        cursor_ += size;
+      }
+      return count;
+    }
+
+  private:
+
+    // Copies a range of the ring; returns false if the producer overwrote it.
+    bool read(uint64_t position, void *data, size_t size) {
+      if (!size) return true;
+      auto capacity = header_->capacity;
+      if (header_->head.load(std::memory_order_acquire) > position + capacity) return false;
+      auto offset = static_cast<size_t>(position % capacity);
+      auto first = std::min(size, static_cast<size_t>(capacity) - offset);
+      memcpy(data, ring_ + offset, first);
+      memcpy(static_cast<uint8_t*>(data) + first, ring_, size - first);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return header_->reserved.load(std::memory_order_relaxed) <= position + capacity;
+    }
+
+    // Jumps to the latest snapshot. Returns false when there is none to
+    // resume from (yet): none was published since an update was lost, or
+    // the latest one was overwritten.
+    bool resynchronize(Subscriber<T> *subscriber) {
+      is_synchronized_ = false;
+      auto snapshot = header_->snapshot.load(std::memory_order_acquire);
+      while (snapshot) {
+        if (load(snapshot - 1, subscriber)) {
+          // the snapshot predates an update lost meanwhile.
+          is_synchronized_ = header_->lost.load(std::memory_order_acquire) <= version_;
+          return is_synchronized_;
+        }
+        // retries only if a newer snapshot was published meanwhile.
+        auto latest = header_->snapshot.load(std::memory_order_acquire);
+        if (latest == snapshot) return false;
+        snapshot = latest;
+      }
+      return false;
+    }
+
+    // Loads the snapshot at 'position', returns false if it was overwritten.
+    bool load(uint64_t position, Subscriber<T> *subscriber) {
+      shm::Record record;
+      if (!read(position, &record, sizeof(record))) return false;
+      std::vector<T> collection(static_cast<size_t>(record.count));
+      if (!read(position + sizeof(record), collection.data(), collection.size() * sizeof(T))) return false;
+      collection_.swap(collection);
+      version_ = record.version;
+      cursor_ = position + shm::padded(sizeof(record) + record.count * sizeof(T));
+      is_synchronized_ = true;
+      if (subscriber) {
+        subscriber->onBufferWillChange();
+        subscriber->onBufferReset(collection_);
+        subscriber->onBufferDidChange();
+      }
+      return true;
+    }
+
+    void notify(Subscriber<T> *subscriber) {
+      if (!subscriber || diffs_.empty()) return;
+      subscriber->onBufferWillChange();
+      for (auto &diff : diffs_)
+        subscriber->onBufferChange(diff.type, diff.index, diff.value);
+      subscriber->onBufferDidChange();
+    }
+  };
+}
+
+#endif /* shm_h */
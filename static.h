@@ -0,0 +1,107 @@
+#ifndef static_h
+#define static_h
+
+#include "diff.h"
+#include <stdio.h>
+#include <vector>
+#include <tuple>
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+namespace buffer {
+
+  namespace detail {
+
+    // std::index_sequence is C++14.
+    template <size_t... Is>
+    struct Indices {};
+
+    template <size_t N, size_t... Is>
+    struct MakeIndices: MakeIndices<N - 1, N - 1, Is...> {};
+
+    template <size_t... Is>
+    struct MakeIndices<0, Is...> {
+      typedef Indices<Is...> type;
+    };
+  }
+
+  // A buffer whose subscribers are fixed at compile time.
+  //
+  // The subscribers can be of any type exposing 'onBufferWillChange()',
+  // 'onBufferDidChange()' and 'onBufferChange(DiffType, size_t, const T &)'
+  // (classes deriving from 'Subscriber<T>' qualify too, and are devirtualized
+  // when declared 'final'). Their calls are resolved statically and issued
+  // straight from the diff traceback, so no script is materialized, no value
+  // is copied and no indirect call is made per change. The elements are
+  // compared with '==' unless a compare function is set, which is then
+  // called (indirectly, on copies of the elements) for every comparison.
+  //
+  // Unlike 'Buffer', the changes are always computed synchronously, on the
+  // thread calling 'setCollection'.
+  template <typename T, typename... Subs>
+  class StaticBuffer {
+  private:
+    std::tuple<Subs&...> subscribers_;
+    std::shared_ptr<const std::vector<T>> front_buffer_;
+    std::function<bool (T, T)> compare_fnc_ = nullptr;
+
+  public:
+
+    explicit StaticBuffer(Subs&... subscribers):
+        subscribers_(subscribers...),
+        front_buffer_(std::make_shared<const std::vector<T>>()) {}
+
+    // Returns all the element currently exposed from the buffer.
+    const std::vector<T> &getCollection() const {
+      return *front_buffer_;
+    }
+
+    // Override the '==' function for the collection wrapped. Costs an
+    // indirect call and two copies per comparison, in the diff's inner loop.
+    void setCompareFunction(const std::function<bool (T, T)> compare) {
+      compare_fnc_ = compare;
+    }
+
+    // Updates the collection, compute the diffs and notifies the subscribers.
+    void setCollection(std::vector<T> collection) {
+      auto previous = front_buffer_;
+      auto &x = *previous;
+      auto is_changed = x.size() != collection.size() || (compare_fnc_
+          ? !std::equal(x.begin(), x.end(), collection.begin(), compare_fnc_)
+          : !std::equal(x.begin(), x.end(), collection.begin()));
+      if (!is_changed) return;
+
+      auto indices = typename detail::MakeIndices<sizeof...(Subs)>::type();
+      willChange(indices);
+      front_buffer_ = std::make_shared<const std::vector<T>>(std::move(collection));
+      diffVisit(x, *front_buffer_, compare_fnc_, [&](DiffType type, size_t index, const T &value, const T &) {
+        change(indices, type, index, value);
+      });
+      didChange(indices);
+    }
+
+  private:
+
+    // the calls are unrolled in the order the subscribers were declared.
+    template <size_t... Is>
+    void willChange(detail::Indices<Is...>) {
+      int unused[] = {0, (std::get<Is>(subscribers_).onBufferWillChange(), 0)...};
+      (void)unused;
+    }
+
+    template <size_t... Is>
+    void didChange(detail::Indices<Is...>) {
+      int unused[] = {0, (std::get<Is>(subscribers_).onBufferDidChange(), 0)...};
+      (void)unused;
+    }
+
+    template <size_t... Is>
+    void change(detail::Indices<Is...>, DiffType type, size_t index, const T &value) {
+      int unused[] = {0, (std::get<Is>(subscribers_).onBufferChange(type, index, value), 0)...};
+      (void)unused;
+    }
+  };
+}
+
+#endif /* static_h */
@@ -0,0 +1,209 @@
+#ifndef trace_h
+#define trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+// Tracing hooks, compiled in only when BUFFER_TRACING is defined, e.g.
+//
+//   g++ -DBUFFER_TRACING ...
+//   buffer::trace::save("buffer.json");   // opens in Perfetto or chrome://tracing
+//
+// 'BUFFER_TRACE_SCOPE(name)' records the span of the enclosing scope and
+// 'BUFFER_TRACE_INSTANT(name)' a point in time. The names must be string
+// literals (only the pointer is kept).
+#ifdef BUFFER_TRACING
+#define BUFFER_TRACE_CONCAT_(a, b) a##b
+#define BUFFER_TRACE_CONCAT(a, b) BUFFER_TRACE_CONCAT_(a, b)
+#define BUFFER_TRACE_SCOPE(name) ::buffer::trace::Scope BUFFER_TRACE_CONCAT(buffer_trace_scope_, __LINE__)(name)
+#define BUFFER_TRACE_INSTANT(name) ::buffer::trace::instant(name)
+#else
+#define BUFFER_TRACE_SCOPE(name) ((void)0)
+#define BUFFER_TRACE_INSTANT(name) ((void)0)
+#endif
+
+namespace buffer {
+
+  namespace trace {
+
+    // The events of a thread, overwriting the oldest ones when full. The
+    // thread writes without any lock; the exporter reads concurrently and
+    // skips the slots being overwritten (every slot is a seqlock).
+    class Ring {
+    public:
+      static const size_t kCapacity = 1 << 14;
+
+    private:
+      struct Slot {
+        std::atomic<uint64_t> sequence;   // 2 * (index + 1) once written, odd while writing.
+        std::atomic<const char*> name;
+        std::atomic<uint64_t> begin;      // Nanoseconds since the trace epoch.
+        std::atomic<uint64_t> duration;   // Nanoseconds, or ~0 for an instant.
+      };
+
+      std::unique_ptr<Slot[]> slots_;
+      std::atomic<uint64_t> head_;
+      uint32_t thread_;
+
+    public:
+
+      struct Event {
+        const char *name;
+        uint64_t begin;
+        uint64_t duration;
+      };
+
+      explicit Ring(uint32_t thread): slots_(new Slot[kCapacity]()), head_(0), thread_(thread) {}
+
+      uint32_t thread() const {
+        return thread_;
+      }
+
+      // Called only by the owning thread.
+      void push(const char *name, uint64_t begin, uint64_t duration) {
+        auto index = head_.load(std::memory_order_relaxed);
+        auto &slot = slots_[index % kCapacity];
+        slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.begin.store(begin, std::memory_order_relaxed);
+        slot.duration.store(duration, std::memory_order_relaxed);
+        slot.sequence.store(2 * (index + 1), std::memory_order_release);
+        head_.store(index + 1, std::memory_order_release);
+      }
+
+      // The events currently in the ring, oldest first.
+      std::vector<Event> events() const {
+        std::vector<Event> result;
+        auto head = head_.load(std::memory_order_acquire);
+        for (auto index = head > kCapacity ? head - kCapacity : 0; index < head; index++) {
+          auto &slot = slots_[index % kCapacity];
+          auto sequence = slot.sequence.load(std::memory_order_acquire);
+          auto event = Event{slot.name.load(std::memory_order_relaxed),
+                             slot.begin.load(std::memory_order_relaxed),
+                             slot.duration.load(std::memory_order_relaxed)};
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (sequence == 2 * (index + 1) && slot.sequence.load(std::memory_order_relaxed) == sequence)
+            result.push_back(event);
+        }
+        return result;
+      }
+    };
+
+    // The rings of all the threads that traced. The ring of a thread outlives
+    // it so its events can still be exported, and is handed over to the next
+    // thread starting to trace (whose events share its lane), so there are
+    // never more rings than threads tracing at the same time.
+    struct Registry {
+      std::mutex lock;
+      std::vector<std::shared_ptr<Ring>> rings;
+      std::vector<std::shared_ptr<Ring>> free;
+      std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    };
+
+    // never destroyed: threads may still exit (and return their ring) while
+    // the static objects are being destroyed.
+    inline Registry &registry() {
+      static Registry *registry = new Registry();
+      return *registry;
+    }
+
+    // Returns the ring of a thread to the registry when the thread exits.
+    struct RingHolder {
+      std::shared_ptr<Ring> ring;
+
+      ~RingHolder() {
+        if (!ring) return;
+        auto &registry = trace::registry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+        registry.free.push_back(std::move(ring));
+      }
+    };
+
+    // The ring of the calling thread, acquired on first use.
+    inline Ring &ring() {
+      static thread_local RingHolder holder;
+      if (!holder.ring) {
+        auto &registry = trace::registry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+        if (!registry.free.empty()) {
+          holder.ring = std::move(registry.free.back());
+          registry.free.pop_back();
+        } else {
+          holder.ring = std::make_shared<Ring>(static_cast<uint32_t>(registry.rings.size() + 1));
+          registry.rings.push_back(holder.ring);
+        }
+      }
+      return *holder.ring;
+    }
+
+    inline uint64_t now() {
+      auto elapsed = std::chrono::steady_clock::now() - registry().epoch;
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    inline void instant(const char *name) {
+      ring().push(name, now(), ~0ull);
+    }
+
+    // Records the span between its construction and its destruction.
+    class Scope {
+    private:
+      const char *name_;
+      uint64_t begin_;
+
+    public:
+      explicit Scope(const char *name): name_(name), begin_(now()) {}
+
+      Scope(const Scope&) = delete;
+      Scope &operator=(const Scope&) = delete;
+
+      ~Scope() {
+        ring().push(name_, begin_, now() - begin_);
+      }
+    };
+
+    // The events of all the threads in the Chrome trace-event format.
+    inline std::string json() {
+      auto &registry = trace::registry();
+      registry.lock.lock();
+      auto rings = registry.rings;
+      registry.lock.unlock();
+
+      std::string result = "{\"traceEvents\":[";
+      char event[256];
+      auto is_first = true;
+      for (auto &ring : rings) {
+        for (auto &e : ring->events()) {
+          if (e.duration == ~0ull)
+            snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"cat\":\"buffer\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+                     is_first ? "" : ",", e.name, e.begin / 1000.0, ring->thread());
+          else
+            snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"cat\":\"buffer\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                     is_first ? "" : ",", e.name, e.begin / 1000.0, e.duration / 1000.0, ring->thread());
+          result += event;
+          is_first = false;
+        }
+      }
+      result += "],\"displayTimeUnit\":\"ns\"}\n";
+      return result;
+    }
+
+    // Writes the trace to 'path'; false on failure.
+    inline bool save(const std::string &path) {
+      auto file = fopen(path.c_str(), "w");
+      if (!file) return false;
+      auto trace = json();
+      auto is_written = fwrite(trace.data(), 1, trace.size(), file) == trace.size();
+      return fclose(file) == 0 && is_written;
+    }
+  }
+}
+
+#endif /* trace_h */